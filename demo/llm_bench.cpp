@@ -0,0 +1,356 @@
+#include "common.h"
+#include "log.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rapidjson/prettywriter.h"
+#include "rapidjson/stringbuffer.h"
+#include "param_json.hpp"
+#include "control_engine.hpp"
+#include "bench_util.hpp"
+
+//延迟基准测试:按语句文件逐条走与llm_demo相同的ControlEngine流程,统计各阶段耗时的分布.
+//线程数、n_batch和缓存模式可以扫描,每种组合单独创建上下文,结果输出为JSON或CSV,用于比较不同量化的gguf
+
+struct BenchConfig{
+    int n_threads = 4;
+    int n_batch = 512;
+    bool cache = true; //false时关闭规则、指令缓存和语义缓存,所有语句都经过模型
+};
+
+struct BenchUtterance{
+    std::string text;
+    bool chat = false;
+};
+
+struct BenchResult{
+    BenchConfig config;
+    int n_requests = 0;
+    int n_errors = 0;
+    int n_early_stop = 0;   //提前结束的请求数
+    int n_saved_decode = 0; //提前结束省去的decode次数
+    std::map<std::string, int> sources; //model/rules/cache/semantic的次数
+    std::vector<StageSamples> stages;
+};
+
+//语句文件每行一条,与控制台相同,带有"-c"的为指令控制模式,否则为知识问答;空行和#开头的行忽略
+static bool load_utterances(const char * path, std::vector<BenchUtterance> & out) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        BenchUtterance u;
+        size_t pos;
+        if ((pos = line.find("-c")) != std::string::npos) {
+            line.erase(pos, 2);
+            u.chat = false;
+        } else {
+            u.chat = true;
+        }
+        u.text = line;
+        out.push_back(u);
+    }
+    return !out.empty();
+}
+
+static bool run_config(common_params params, llama_model * model, const char * param_path, const std::vector<BenchUtterance> & utterances,
+                       int repeat, int warmup, BenchResult & result) {
+    const BenchConfig & config = result.config;
+    params.cpuparams.n_threads = config.n_threads;
+    params.cpuparams_batch.n_threads = config.n_threads;
+    params.n_batch = config.n_batch;
+    params.n_ubatch = std::min(params.n_ubatch, config.n_batch);
+    params.n_parallel = kSeqWork + kSeqPerSession;
+    params.kv_unified = true;
+
+    //每个组合重新读取param.json,缓存不持久化,保证各组合都从冷缓存开始
+    ParamJson param_json(param_path);
+    if (param_json.GetParam() != 0) {
+        return false;
+    }
+    param_json.runtime.cache_path.clear();
+    if (!config.cache) {
+        param_json.runtime.rules = false;
+        param_json.runtime.cache = false;
+        param_json.runtime.semantic_cache_path.clear();
+    }
+
+    llama_context * ctx = llama_init_from_model(model, common_context_params_to_llama(params));
+    if (!ctx) {
+        LOG_ERR("%s: failed to create the llama_context\n", __func__);
+        return false;
+    }
+    bool ok = true;
+    {
+        ControlEngine engine(params, model, ctx, param_json);
+        ok = engine.init(params.path_prompt_cache);
+
+        std::vector<EngineStats> samples;
+        EngineCallbacks callbacks;
+        callbacks.on_done = [&samples](const EngineStats & stats) {
+            samples.push_back(stats);
+        };
+        for (int w = 0; ok && w < warmup && w < (int) utterances.size(); w++) {
+            engine.submit(0, utterances[w].text, utterances[w].chat, EngineCallbacks());
+            while (engine.step()) {
+            }
+        }
+        for (int r = 0; ok && r < repeat; r++) {
+            for (const auto & u : utterances) {
+                engine.submit(0, u.text, u.chat, callbacks);
+                while (engine.step()) {
+                }
+            }
+        }
+
+        const char * names[] = {"tokenize_ms", "prefix_restore_ms", "prefill_ms", "first_token_ms", "decode_per_token_ms",
+                                "parse_ms", "end_to_end_ms", "prefill_tok_s", "decode_tok_s"};
+        result.stages.resize(sizeof(names) / sizeof(names[0]));
+        for (size_t i = 0; i < result.stages.size(); i++) {
+            result.stages[i].name = names[i];
+        }
+        for (const auto & s : samples) {
+            result.n_requests++;
+            result.sources[s.source]++;
+            if (s.error) {
+                result.n_errors++;
+                continue;
+            }
+            result.stages[6].values.push_back((s.t_done - s.t_submit) / 1000);
+            result.n_early_stop += s.early_stop ? 1 : 0;
+            result.n_saved_decode += s.n_saved_decode;
+            if (strcmp(s.source, "model") != 0) {
+                if (s.parse_us > 0) {
+                    result.stages[5].values.push_back(s.parse_us / 1000);
+                }
+                continue;
+            }
+            //模型阶段只统计真正经过模型的请求,快速通道命中不计入
+            result.stages[0].values.push_back(s.tokenize_us / 1000);
+            result.stages[1].values.push_back(s.prefix_us / 1000);
+            result.stages[2].values.push_back(s.prefill_us / 1000);
+            if (s.t_first_token > 0) {
+                result.stages[3].values.push_back((s.t_first_token - s.t_submit) / 1000);
+            }
+            if (s.n_decode > 0) {
+                result.stages[4].values.push_back(s.decode_us / s.n_decode / 1000);
+                result.stages[8].values.push_back(s.n_decode * 1e6 / s.decode_us);
+            }
+            result.stages[5].values.push_back(s.parse_us / 1000);
+            if (s.prefill_us > 0) {
+                result.stages[7].values.push_back(s.n_prompt * 1e6 / s.prefill_us);
+            }
+        }
+        for (auto & stage : result.stages) {
+            std::sort(stage.values.begin(), stage.values.end());
+        }
+    }
+    llama_free(ctx);
+    return ok;
+}
+
+static void write_json(const std::vector<BenchResult> & results, const char * model_path, std::ostream & out) {
+    rapidjson::StringBuffer sb;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> w(sb);
+    w.StartObject();
+    w.Key("model");
+    w.String(model_path);
+    w.Key("runs");
+    w.StartArray();
+    for (const auto & r : results) {
+        w.StartObject();
+        w.Key("threads");
+        w.Int(r.config.n_threads);
+        w.Key("n_batch");
+        w.Int(r.config.n_batch);
+        w.Key("cache");
+        w.Bool(r.config.cache);
+        w.Key("requests");
+        w.Int(r.n_requests);
+        w.Key("errors");
+        w.Int(r.n_errors);
+        w.Key("early_stops");
+        w.Int(r.n_early_stop);
+        w.Key("saved_decodes");
+        w.Int(r.n_saved_decode);
+        w.Key("sources");
+        w.StartObject();
+        for (const auto & s : r.sources) {
+            w.Key(s.first.c_str());
+            w.Int(s.second);
+        }
+        w.EndObject();
+        w.Key("stages");
+        w.StartObject();
+        for (const auto & stage : r.stages) {
+            w.Key(stage.name.c_str());
+            write_summary(w, stage.values);
+        }
+        w.EndObject();
+        w.EndObject();
+    }
+    w.EndArray();
+    w.EndObject();
+    out << sb.GetString() << std::endl;
+}
+
+static void write_csv(const std::vector<BenchResult> & results, std::ostream & out) {
+    out << "threads,n_batch,cache,stage,n,mean,p50,p90,p99" << std::endl;
+    for (const auto & r : results) {
+        for (const auto & stage : r.stages) {
+            char line[256];
+            snprintf(line, sizeof(line), "%d,%d,%s,%s,%zu,%.3f,%.3f,%.3f,%.3f", r.config.n_threads, r.config.n_batch,
+                     r.config.cache ? "on" : "off", stage.name.c_str(), stage.values.size(), mean(stage.values),
+                     percentile(stage.values, 50), percentile(stage.values, 90), percentile(stage.values, 99));
+            out << line << std::endl;
+        }
+    }
+}
+
+static void print_usage() {
+    std::cout << "please input:\n"
+              << "model.gguf\n"
+              << "prompt_path\n"
+              << "param.json\n"
+              << "utterances.txt (one per line, \"-c\" marks control mode)\n"
+              << "options:\n"
+              << "  --threads 2,4,8    thread counts to sweep (default 4)\n"
+              << "  --batch 256,512    n_batch values to sweep (default 512)\n"
+              << "  --cache on,off     with off, rules/command cache/semantic cache are disabled (default on)\n"
+              << "  --repeat N         passes over the utterance file (default 3)\n"
+              << "  --warmup N         leading utterances run once before measuring (default 1)\n"
+              << "  --format json|csv  (default json)\n"
+              << "  --out file         (default stdout)\n"
+              << "  --trace file       write a Chrome trace of all runs" << std::endl;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 5) {
+        print_usage();
+        return 0;
+    }
+    std::vector<int> threads = {4};
+    std::vector<int> batches = {512};
+    std::vector<bool> caches = {true};
+    int repeat = 3;
+    int warmup = 1;
+    std::string format = "json";
+    std::string out_path;
+    std::string trace_path;
+    for (int i = 5; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            print_usage();
+            return 1;
+        }
+        const char * value = argv[++i];
+        if (arg == "--threads") {
+            threads = parse_int_list(value);
+        } else if (arg == "--batch") {
+            batches = parse_int_list(value);
+        } else if (arg == "--cache") {
+            caches.clear();
+            if (strstr(value, "on")) {
+                caches.push_back(true);
+            }
+            if (strstr(value, "off")) {
+                caches.push_back(false);
+            }
+        } else if (arg == "--repeat") {
+            repeat = std::max(1, atoi(value));
+        } else if (arg == "--warmup") {
+            warmup = std::max(0, atoi(value));
+        } else if (arg == "--format") {
+            format = value;
+        } else if (arg == "--out") {
+            out_path = value;
+        } else if (arg == "--trace") {
+            trace_path = value;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (threads.empty() || batches.empty() || caches.empty() || (format != "json" && format != "csv")) {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<BenchUtterance> utterances;
+    if (!load_utterances(argv[4], utterances)) {
+        LOG_ERR("%s: failed to read utterances from '%s'\n", __func__, argv[4]);
+        return 1;
+    }
+
+    common_params params;
+    params.model.path = argv[1];
+    params.path_prompt_cache = argv[2];
+    Trace::enable(!trace_path.empty());
+    common_init();
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    //模型只加载一次,每种组合只重新创建上下文
+    llama_model * model = llama_model_load_from_file(params.model.path.c_str(), common_model_params_to_llama(params));
+    if (model == NULL) {
+        LOG_ERR("%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    for (int n_threads : threads) {
+        for (int n_batch : batches) {
+            for (bool cache : caches) {
+                BenchResult result;
+                result.config.n_threads = n_threads;
+                result.config.n_batch = n_batch;
+                result.config.cache = cache;
+                LOG_INF("%s: threads %d, n_batch %d, cache %s\n", __func__, n_threads, n_batch, cache ? "on" : "off");
+                if (!run_config(params, model, argv[3], utterances, repeat, warmup, result)) {
+                    LOG_ERR("%s: run failed: threads %d, n_batch %d\n", __func__, n_threads, n_batch);
+                    llama_model_free(model);
+                    return 1;
+                }
+                results.push_back(result);
+            }
+        }
+    }
+    llama_model_free(model);
+    llama_backend_free();
+    if (!trace_path.empty() && !Trace::write(trace_path)) {
+        LOG_ERR("%s: failed to write trace to '%s'\n", __func__, trace_path.c_str());
+    }
+
+    std::ofstream file;
+    if (!out_path.empty()) {
+        file.open(out_path);
+        if (!file) {
+            LOG_ERR("%s: failed to open '%s'\n", __func__, out_path.c_str());
+            return 1;
+        }
+    }
+    std::ostream & out = out_path.empty() ? std::cout : file;
+    if (format == "json") {
+        write_json(results, argv[1], out);
+    } else {
+        write_csv(results, out);
+    }
+    return 0;
+}
@@ -0,0 +1,420 @@
+#include "common.h"
+#include "log.h"
+#include "llama.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rapidjson/document.h"
+#include "rapidjson/prettywriter.h"
+#include "rapidjson/stringbuffer.h"
+#include "param_json.hpp"
+#include "control_engine.hpp"
+#include "bench_util.hpp"
+
+//指令控制的黄金集评测:用同一个模型依次加载多个param.json变体,逐条比较模型输出的指令与期望指令,
+//统计准确率、无效指令率、prompt长度、prefill耗时和端到端延迟,用于挑选又快又准的prompt/schema.
+//黄金集每行一个JSON:
+//  {"text": "亮度调到50", "expected": [{"parameter": "亮度", "value": 50}]}
+//  {"text": "帮我订机票", "expected": "invalid"}
+//期望指令与模型输出一样经过pars_control(类型转换和command_clean),
+//期望中有参数不在该schema中时跳过这一条,不计入准确率
+
+struct GoldenCase{
+    std::string text;
+    std::string expected; //期望指令的JSON文本,"invalid"表示应输出无效指令
+    std::vector<std::string> names; //期望指令中的参数名
+};
+
+struct SchemaResult{
+    std::string path;
+    int n_cases = 0;
+    int n_skipped = 0;       //期望参数不在该schema中
+    int n_exact = 0;
+    int n_invalid = 0;       //期望有效却输出了无效指令
+    int n_errors = 0;
+    int prompt_tokens = 0;   //控制模式system prompt的token数
+    double prefix_prefill_ms = 0; //system prompt冷启动prefill的耗时
+    std::vector<double> turn_tokens;
+    std::vector<double> prefill_ms;
+    std::vector<double> first_command_ms;
+    std::vector<double> end_to_end_ms;
+    std::vector<std::pair<std::string, std::string>> failures; //语句和实际输出
+};
+
+static bool load_golden(const char * path, std::vector<GoldenCase> & out) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    int n_line = 0;
+    while (std::getline(in, line)) {
+        n_line++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        rapidjson::Document doc;
+        if (doc.Parse(line.c_str()).HasParseError() || !doc.IsObject() || !doc.HasMember("text") || !doc["text"].IsString() ||
+            !doc.HasMember("expected")) {
+            LOG_ERR("%s: %s:%d: expected {\"text\": ..., \"expected\": ...}\n", __func__, path, n_line);
+            return false;
+        }
+        GoldenCase c;
+        c.text = doc["text"].GetString();
+        if (doc["expected"].IsString()) {
+            c.expected = doc["expected"].GetString();
+        } else {
+            const rapidjson::Value & expected = doc["expected"];
+            for (size_t i = 0; expected.IsArray() && i < expected.Size(); i++) {
+                if (expected[i].IsObject() && expected[i].HasMember("parameter") && expected[i]["parameter"].IsString()) {
+                    c.names.push_back(expected[i]["parameter"].GetString());
+                }
+            }
+            rapidjson::StringBuffer sb;
+            rapidjson::Writer<rapidjson::StringBuffer> w(sb);
+            doc["expected"].Accept(w);
+            c.expected = sb.GetString();
+        }
+        out.push_back(c);
+    }
+    return !out.empty();
+}
+
+//无效指令只比较名称,提示语不同的schema可能不一样
+static bool same_param(const Iaa_Param_Inter & a, const Iaa_Param_Inter & b) {
+    if (strcmp(a.name, b.name) != 0 || a.value_type != b.value_type) {
+        return false;
+    }
+    if (strcmp(a.name, "无效指令") == 0) {
+        return true;
+    }
+    switch (a.value_type) {
+        case TYPE_BOOL:
+            return a.value.b == b.value.b;
+        case TYPE_INT:
+            return a.value.i == b.value.i;
+        case TYPE_FLOAT:
+            return std::fabs(a.value.f - b.value.f) < 1e-3f;
+        case TYPE_STRING:
+            return strcmp(a.value.s, b.value.s) == 0;
+    }
+    return false;
+}
+
+//与顺序无关的完全匹配
+static bool exact_match(const std::vector<Iaa_Param_Inter> & expected, const std::vector<Iaa_Param_Inter> & got) {
+    if (expected.size() != got.size()) {
+        return false;
+    }
+    std::vector<bool> used(got.size(), false);
+    for (const auto & e : expected) {
+        bool found = false;
+        for (size_t i = 0; i < got.size() && !found; i++) {
+            if (!used[i] && same_param(e, got[i])) {
+                used[i] = found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool has_invalid(const std::vector<Iaa_Param_Inter> & result) {
+    for (const auto & p : result) {
+        if (strcmp(p.name, "无效指令") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::string to_text(const std::vector<Iaa_Param_Inter> & result) {
+    std::string out;
+    char value[64];
+    for (const auto & p : result) {
+        switch (p.value_type) {
+            case TYPE_BOOL: snprintf(value, sizeof(value), "%s", p.value.b ? "true" : "false"); break;
+            case TYPE_INT: snprintf(value, sizeof(value), "%d", p.value.i); break;
+            case TYPE_FLOAT: snprintf(value, sizeof(value), "%g", p.value.f); break;
+            case TYPE_STRING: snprintf(value, sizeof(value), "%s", p.value.s); break;
+        }
+        out += std::string(out.empty() ? "" : ", ") + p.name + "=" + value;
+    }
+    return out;
+}
+
+static bool run_schema(common_params params, llama_model * model, const std::vector<GoldenCase> & cases, SchemaResult & result) {
+    //各schema的前缀保存在同一个prompt缓存文件中,以文件名区分
+    std::string name = result.path.substr(result.path.find_last_of("/\\") + 1);
+    name = name.substr(0, name.rfind(".json"));
+    params.n_parallel = kSeqWork + kSeqPerSession;
+    params.kv_unified = true;
+
+    ParamJson param_json(result.path.c_str());
+    if (param_json.GetParam() != 0) {
+        return false;
+    }
+    //只评测模型本身,关闭规则和各级缓存
+    param_json.runtime.rules = false;
+    param_json.runtime.cache = false;
+    param_json.runtime.cache_path.clear();
+    param_json.runtime.semantic_cache_path.clear();
+
+    llama_context * ctx = llama_init_from_model(model, common_context_params_to_llama(params));
+    if (!ctx) {
+        LOG_ERR("%s: failed to create the llama_context\n", __func__);
+        return false;
+    }
+    bool ok = true;
+    {
+        ControlEngine engine(params, model, ctx, param_json);
+        ok = engine.init(params.path_prompt_cache, name);
+        result.prompt_tokens = (int) engine.ctrl_tokens.size();
+
+        //前缀可能是从缓存文件加载的,在会话0的工作序列上重新prefill一次得到冷启动耗时,之后submit会重置该序列
+        if (ok) {
+            llama_batch batch = llama_batch_init(llama_n_batch(ctx), 0, 1);
+            int n_past = 0;
+            const double t_start = GetCurrentUS();
+            ok = decode_seq(ctx, batch, engine.ctrl_tokens.data(), (int) engine.ctrl_tokens.size(), llama_n_batch(ctx), n_past, kSeqWork);
+            result.prefix_prefill_ms = (GetCurrentUS() - t_start) / 1000;
+            llama_memory_seq_rm(llama_get_memory(ctx), kSeqWork, -1, -1);
+            llama_batch_free(batch);
+        }
+
+        std::vector<Iaa_Param_Inter> got;
+        EngineStats stats;
+        EngineCallbacks callbacks;
+        callbacks.on_command = [&got](const Iaa_Param_Inter & p) {
+            got.push_back(p);
+        };
+        callbacks.on_done = [&stats](const EngineStats & s) {
+            stats = s;
+        };
+        for (size_t i = 0; ok && i < cases.size(); i++) {
+            const GoldenCase & c = cases[i];
+            bool supported = true;
+            for (const auto & n : c.names) {
+                supported = supported && param_json.param_list.count(n) > 0;
+            }
+            if (!supported) {
+                result.n_skipped++;
+                continue;
+            }
+            std::vector<Iaa_Param_Inter> expected;
+            if (c.expected == "invalid") {
+                param_json.push_invalid(expected);
+            } else {
+                param_json.pars_control(c.expected, expected, c.text);
+            }
+            got.clear();
+            engine.submit(0, c.text, false, callbacks);
+            while (engine.step()) {
+            }
+            result.n_cases++;
+            if (stats.error) {
+                result.n_errors++;
+                continue;
+            }
+            if (exact_match(expected, got)) {
+                result.n_exact++;
+            } else {
+                result.failures.push_back(std::make_pair(c.text, to_text(got)));
+            }
+            if (has_invalid(got) && !has_invalid(expected)) {
+                result.n_invalid++;
+            }
+            result.turn_tokens.push_back(stats.n_prompt);
+            result.prefill_ms.push_back(stats.prefill_us / 1000);
+            if (stats.t_first_command > 0) {
+                result.first_command_ms.push_back((stats.t_first_command - stats.t_submit) / 1000);
+            }
+            result.end_to_end_ms.push_back((stats.t_done - stats.t_submit) / 1000);
+        }
+    }
+    llama_free(ctx);
+    return ok;
+}
+
+static double rate(int n, int total) {
+    return total > 0 ? (double) n / total : 0;
+}
+
+static void write_json(const std::vector<SchemaResult> & results, const char * model_path, std::ostream & out) {
+    rapidjson::StringBuffer sb;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> w(sb);
+    w.StartObject();
+    w.Key("model");
+    w.String(model_path);
+    w.Key("schemas");
+    w.StartArray();
+    for (const auto & r : results) {
+        w.StartObject();
+        w.Key("param_json");
+        w.String(r.path.c_str());
+        w.Key("cases");
+        w.Int(r.n_cases);
+        w.Key("skipped");
+        w.Int(r.n_skipped);
+        w.Key("accuracy");
+        w.Double(rate(r.n_exact, r.n_cases));
+        w.Key("invalid_rate");
+        w.Double(rate(r.n_invalid, r.n_cases));
+        w.Key("errors");
+        w.Int(r.n_errors);
+        w.Key("prompt_tokens");
+        w.Int(r.prompt_tokens);
+        w.Key("prefix_prefill_ms");
+        w.Double(r.prefix_prefill_ms);
+        w.Key("turn_prompt_tokens");
+        write_summary(w, r.turn_tokens);
+        w.Key("prefill_ms");
+        write_summary(w, r.prefill_ms);
+        w.Key("first_command_ms");
+        write_summary(w, r.first_command_ms);
+        w.Key("end_to_end_ms");
+        write_summary(w, r.end_to_end_ms);
+        w.Key("failures");
+        w.StartArray();
+        for (const auto & f : r.failures) {
+            w.StartObject();
+            w.Key("text");
+            w.String(f.first.c_str());
+            w.Key("got");
+            w.String(f.second.c_str());
+            w.EndObject();
+        }
+        w.EndArray();
+        w.EndObject();
+    }
+    w.EndArray();
+    w.EndObject();
+    out << sb.GetString() << std::endl;
+}
+
+static void write_csv(const std::vector<SchemaResult> & results, std::ostream & out) {
+    out << "param_json,cases,skipped,accuracy,invalid_rate,errors,prompt_tokens,prefix_prefill_ms,"
+           "prefill_ms_p50,first_command_ms_p50,end_to_end_ms_p50,end_to_end_ms_p90,end_to_end_ms_p99" << std::endl;
+    for (const auto & r : results) {
+        std::vector<double> prefill = r.prefill_ms;
+        std::vector<double> first = r.first_command_ms;
+        std::vector<double> e2e = r.end_to_end_ms;
+        std::sort(prefill.begin(), prefill.end());
+        std::sort(first.begin(), first.end());
+        std::sort(e2e.begin(), e2e.end());
+        char line[512];
+        snprintf(line, sizeof(line), "%s,%d,%d,%.4f,%.4f,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f", r.path.c_str(), r.n_cases, r.n_skipped,
+                 rate(r.n_exact, r.n_cases), rate(r.n_invalid, r.n_cases), r.n_errors, r.prompt_tokens, r.prefix_prefill_ms,
+                 percentile(prefill, 50), percentile(first, 50), percentile(e2e, 50), percentile(e2e, 90), percentile(e2e, 99));
+        out << line << std::endl;
+    }
+}
+
+static void print_usage() {
+    std::cout << "please input:\n"
+              << "model.gguf\n"
+              << "prompt_path (all schemas share this cache file, one entry per schema)\n"
+              << "golden.jsonl\n"
+              << "param.json [param_new.json ...]\n"
+              << "options:\n"
+              << "  --threads N        (default 4)\n"
+              << "  --format json|csv  (default json)\n"
+              << "  --out file         (default stdout)" << std::endl;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 5) {
+        print_usage();
+        return 0;
+    }
+    int n_threads = 4;
+    std::string format = "json";
+    std::string out_path;
+    std::vector<std::string> schemas;
+    for (int i = 4; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            schemas.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            print_usage();
+            return 1;
+        }
+        const char * value = argv[++i];
+        if (arg == "--threads") {
+            n_threads = atoi(value);
+        } else if (arg == "--format") {
+            format = value;
+        } else if (arg == "--out") {
+            out_path = value;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (schemas.empty() || n_threads <= 0 || (format != "json" && format != "csv")) {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<GoldenCase> cases;
+    if (!load_golden(argv[3], cases)) {
+        LOG_ERR("%s: failed to read golden set from '%s'\n", __func__, argv[3]);
+        return 1;
+    }
+
+    common_params params;
+    params.model.path = argv[1];
+    params.path_prompt_cache = argv[2];
+    params.cpuparams.n_threads = n_threads;
+    params.cpuparams_batch.n_threads = n_threads;
+    common_init();
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    llama_model * model = llama_model_load_from_file(params.model.path.c_str(), common_model_params_to_llama(params));
+    if (model == NULL) {
+        LOG_ERR("%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+
+    std::vector<SchemaResult> results;
+    for (const auto & schema : schemas) {
+        SchemaResult result;
+        result.path = schema;
+        LOG_INF("%s: evaluating %s\n", __func__, schema.c_str());
+        if (!run_schema(params, model, cases, result)) {
+            LOG_ERR("%s: failed to evaluate %s\n", __func__, schema.c_str());
+            llama_model_free(model);
+            return 1;
+        }
+        results.push_back(result);
+    }
+    llama_model_free(model);
+    llama_backend_free();
+
+    std::ofstream file;
+    if (!out_path.empty()) {
+        file.open(out_path);
+        if (!file) {
+            LOG_ERR("%s: failed to open '%s'\n", __func__, out_path.c_str());
+            return 1;
+        }
+    }
+    std::ostream & out = out_path.empty() ? std::cout : file;
+    if (format == "json") {
+        write_json(results, argv[1], out);
+    } else {
+        write_csv(results, out);
+    }
+    return 0;
+}
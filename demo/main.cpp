@@ -6,17 +6,27 @@
 #include "llama.h"
 #include "chat.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "param_json.hpp"
-#include <sys/time.h>  
+#include "control_engine.hpp"
+#include "control_server.hpp"
+#include "thread_pools.hpp"
+#include "thread_tuner.hpp"
 
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
 #include <signal.h>
@@ -41,67 +51,157 @@
 static std::vector<llama_token> * g_input_tokens;
 static std::ostringstream       * g_output_ss;
 static std::vector<llama_token> * g_output_tokens;
-static bool is_interacting  = false;
+static std::atomic<bool> is_interacting(false); //控制台等待输入时为true,引擎循环写入,SIGINT处理函数读取
+static volatile bool g_stop = false; //守护进程模式下收到SIGINT/SIGTERM后退出
+static OpProfiler * g_profiler = nullptr;
+static ControlEngine * g_engine = nullptr;
 
-static bool file_exists(const std::string & path) {
-    std::ifstream f(path.c_str());
-    return f.good();
+static void stop_handler(int) {
+    g_stop = true;
 }
 
-static bool file_is_empty(const std::string & path) {
-    std::ifstream f;
-    f.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    f.open(path.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
-    return f.tellg() == 0;
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__)) || defined (_WIN32)
+//控制台模式下Ctrl+C:生成过程中取消正在进行的请求(引擎的abort回调会中断正在进行的decode),
+//等待输入时输出累计的算子统计和两类请求的延迟后退出
+static void sigint_handler(int signo) {
+    if (signo == SIGINT) {
+        if (!is_interacting && g_engine) {
+            g_engine->request_cancel(0);
+            return;
+        }
+        console::cleanup();
+        if (g_profiler) {
+            LOG("\n%s", g_profiler->report(false, 0).c_str());
+        }
+        if (g_engine) {
+            g_engine->log_latency();
+        }
+        LOG("Interrupted by user\n");
+        common_log_pause(common_log_main());
+        _exit(130);
+    }
 }
+#endif
 
-inline double GetCurrentUS() {
-  struct timeval time;
-  gettimeofday(&time, NULL);
-  return 1e+6 * time.tv_sec + time.tv_usec;
+static void print_param(const Iaa_Param_Inter & p) {
+    std::cout << "[param_name = " << p.name << "] ";
+    switch (p.value_type) {
+        case TYPE_BOOL:
+            std::cout << "bool_value = " << p.value.b;
+            break;
+        case TYPE_INT:
+            std::cout << "int_value = " << p.value.i;
+            break;
+        case TYPE_FLOAT:
+            std::cout << "float_value = " << p.value.f;
+            break;
+        case TYPE_STRING:
+            std::cout << "str_value = " << p.value.s;
+            break;
+    }
+    std::cout << std::endl;
+}
+
+//与llama.cpp同名的线程池参数,带-batch的作用于prefill线程池,否则作用于decode线程池
+static bool parse_pool_flag(const std::string & arg, const char * value, ThreadPoolConfig & prefill, ThreadPoolConfig & decode) {
+    if (arg == "-tb" || arg == "--threads-batch") {
+        prefill.n_threads = atoi(value);
+    } else if (arg == "-C" || arg == "--cpu-mask") {
+        decode.cpumask = value;
+    } else if (arg == "-Cb" || arg == "--cpu-mask-batch") {
+        prefill.cpumask = value;
+    } else if (arg == "-Cr" || arg == "--cpu-range") {
+        decode.cpu_range = value;
+    } else if (arg == "-Crb" || arg == "--cpu-range-batch") {
+        prefill.cpu_range = value;
+    } else if (arg == "--prio") {
+        decode.priority = atoi(value);
+    } else if (arg == "--prio-batch") {
+        prefill.priority = atoi(value);
+    } else if (arg == "--poll") {
+        decode.poll = atoi(value);
+    } else if (arg == "--poll-batch") {
+        prefill.poll = atoi(value);
+    } else if (arg == "--cpu-strict") {
+        decode.strict_cpu = atoi(value);
+    } else if (arg == "--cpu-strict-batch") {
+        prefill.strict_cpu = atoi(value);
+    } else {
+        return false;
+    }
+    return true;
 }
 
 int main(int argc, char ** argv) {
-    if (argc != 5) {
+    //位置参数之外可以用线程池参数覆盖param.json中的"threadpool"配置
+    std::vector<char *> args;
+    ThreadPoolConfig prefill_flags;
+    ThreadPoolConfig decode_flags;
+    std::string autotune_flag;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--autotune") == 0 && i + 1 < argc) {
+            autotune_flag = argv[++i];
+        } else if (argv[i][0] == '-' && i + 1 < argc && parse_pool_flag(argv[i], argv[i + 1], prefill_flags, decode_flags)) {
+            i++;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 4 && args.size() != 5) {
         std::cout << "please input:\n"
                   << "model.gguf\n"
                   << "thread\n"
                   << "prompt_path\n"
-                  << "param.json" << std::endl;
+                  << "param.json\n"
+                  << "[socket_path] (optional, run as a daemon on this unix socket)\n"
+                  << "threadpool options (override \"threadpool\" in param.json):\n"
+                  << "  -tb N, -C/-Cb mask, -Cr/-Crb lo-hi, --prio/--prio-batch N, --poll/--poll-batch N, --cpu-strict/--cpu-strict-batch 0|1\n"
+                  << "  --autotune off|auto|force (override \"autotune\" in param.json)" << std::endl;
         return 0;
     }
 
     //init part
     double start, duration;
-    std::vector<Iaa_Param_Inter> result;
-    ParamJson param_json(argv[4]);
+    ParamJson param_json(args[3]);
     param_json.GetParam();
+    const RuntimeConfig & runtime = param_json.runtime;
 
     common_params params;
-    params.model.path = argv[1];
-    params.cpuparams.n_threads = atoi(argv[2]);
-    params.cpuparams_batch.n_threads = atoi(argv[2]);
-    params.path_prompt_cache = argv[3];
+    params.model.path = args[0];
+    params.cpuparams.n_threads = atoi(args[1]);
+    params.cpuparams_batch.n_threads = atoi(args[1]);
+    //prefill和decode的线程池可以分别设置线程数和绑定的CPU,命令行在param.json之后应用,优先级更高
+    if (!ThreadPools::apply(runtime.prefill_pool, params.cpuparams_batch) || !ThreadPools::apply(prefill_flags, params.cpuparams_batch) ||
+        !ThreadPools::apply(runtime.decode_pool, params.cpuparams) || !ThreadPools::apply(decode_flags, params.cpuparams)) {
+        LOG_ERR("%s: invalid threadpool cpumask or cpu range\n", __func__);
+        return 1;
+    }
+    params.path_prompt_cache = args[2];
     params.interactive = true;
+    params.n_parallel = kSeqWork + kSeqPerSession * runtime.sessions; //kSeqCtrl、kSeqChat以及每个会话的控制和问答序列
+    params.kv_unified = true; //各序列共享前缀的KV单元,见ControlEngine
+    if (runtime.n_ctx > 0) {
+        params.n_ctx = runtime.n_ctx;
+    }
+    OpProfiler profiler;
+    if (runtime.profile_ops) {
+        profiler.install(params);
+        g_profiler = &profiler;
+    }
    
     //g_params = &params;
+    Trace::enable(!runtime.trace_path.empty());
     start = GetCurrentUS();
     common_init();
 
-    auto & sparams = params.sampling;
-
     llama_backend_init();
     llama_numa_init(params.numa); //禁用ggml的numa
 
     llama_model * model = nullptr;
     llama_context * ctx = nullptr;
-    common_sampler * smpl = nullptr;
 
     //g_model = &model;
     //g_ctx = &ctx;
-    //g_smpl = &smpl;
-
-    std::vector<common_chat_msg> chat_msgs;
 
     common_init_result llama_init = common_init_from_params(params);
     model = llama_init.model.get();
@@ -112,38 +212,17 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    auto * mem = llama_get_memory(ctx);
+    set_process_priority(params.cpuparams.priority);
+
+    //线程数自动调优:auto时优先使用缓存中当前模型和CPU的结果,force时重新测量
+    ThreadTuner::autotune(autotune_flag.empty() ? runtime.autotune : autotune_flag,
+                          runtime.autotune_path.empty() ? params.path_prompt_cache + ".threads.json" : runtime.autotune_path, params, ctx);
 
-    smpl = common_sampler_init(model, sparams);
-    if (!smpl) {
-        LOG_ERR("%s: failed to initialize sampling subsystem\n", __func__);
+    //prefill和decode使用各自的线程池,配置相同时只有一个
+    ThreadPools threadpools;
+    if (!threadpools.init(params, ctx)) {
         return 1;
     }
-    // LOG_INF("sampler seed: %u\n",     common_sampler_get_seed(smpl));
-    // LOG_INF("sampler params: \n%s\n", sparams.print().c_str());
-    // LOG_INF("sampler chain: %s\n",    common_sampler_print(smpl).c_str());
-
-    const llama_vocab * vocab = llama_model_get_vocab(model); //获取词汇表
-    auto chat_templates = common_chat_templates_init(model, params.chat_template); //获取chat的特殊字符
-
-    // auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
-    // if (!cpu_dev) {
-    //     LOG_ERR("%s: no CPU backend found\n", __func__);
-    //     return 1;
-    // }
-    // auto * reg = ggml_backend_dev_backend_reg(cpu_dev);
-    // auto * ggml_threadpool_new_fn = (decltype(ggml_threadpool_new) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
-    // auto * ggml_threadpool_free_fn = (decltype(ggml_threadpool_free) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
-
-    // struct ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(params.cpuparams);
-
-    set_process_priority(params.cpuparams.priority);
-
-    // struct ggml_threadpool * threadpool = ggml_threadpool_new_fn(&tpp);
-    // if (!threadpool) {
-    //     LOG_ERR("%s: threadpool create failed : n_threads %d\n", __func__, tpp.n_threads);
-    //     return 1;
-    // }
 
     const int n_ctx_train = llama_model_n_ctx_train(model);
     const int n_ctx = llama_n_ctx(ctx);
@@ -151,9 +230,30 @@ int main(int argc, char ** argv) {
     if (n_ctx > n_ctx_train) {
         LOG_WRN("%s: model was trained on only %d context tokens (%d specified)\n", __func__, n_ctx_train, n_ctx);
     }
+    if (runtime.chat_group_attn.n != 1 || runtime.control_group_attn.n != 1) {
+        LOG_INF("self-extend: n_ctx_train = %d, chat grp_attn_n = %d, grp_attn_w = %d, control grp_attn_n = %d, grp_attn_w = %d\n", n_ctx_train,
+                runtime.chat_group_attn.n, runtime.chat_group_attn.w, runtime.control_group_attn.n, runtime.control_group_attn.w);
+    }
+
+    duration = GetCurrentUS()-start;
+    std::cout << "load model use time:" << duration/1000 << std::endl;
+
+    //加载两种模式的system prompt,分别预填充到各自的KV序列,缓存文件不存在时会自动生成
+    start = GetCurrentUS();
+    ControlEngine engine(params, model, ctx, param_json);
+    if (runtime.profile_ops) {
+        engine.set_profiler(&profiler);
+    }
+    engine.set_thread_pools(&threadpools);
+    if (!engine.init(params.path_prompt_cache)) {
+        return -1;
+    }
+    g_engine = &engine;
+    duration = GetCurrentUS() - start;
+    std::cout << "load prompt use time:" << duration / 1000 << std::endl;
 
     // 如果能获取到chat的特殊字符,并且模式是auto(如果设置了-cnv或-no-cnv就不会自动转了),则自动转为对话,否则转为文本生成
-    const bool has_chat_template = common_chat_templates_was_explicit(chat_templates.get());
+    const bool has_chat_template = common_chat_templates_was_explicit(engine.chat_templates());
     if (params.conversation_mode == COMMON_CONVERSATION_MODE_AUTO) {
         if (has_chat_template) {
             LOG_INF("%s: chat template is available, enabling conversation mode (disable it with -no-cnv)\n", __func__);
@@ -168,274 +268,187 @@ int main(int argc, char ** argv) {
         LOG_WRN("%s: chat template is not available or is not supported. This may cause the model to output suboptimal responses\n", __func__);
     }
 
-    //负责根据传入的role和content,按照chat_templates的特殊格式进行组合排列
-    auto chat_add_and_format = [&chat_msgs, &chat_templates](const std::string & role, const std::string & content) {
-        common_chat_msg new_msg;
-        new_msg.role = role;
-        new_msg.content = content;
-        auto formatted = common_chat_format_single(chat_templates.get(), chat_msgs, new_msg, role == "user", false);
-        chat_msgs.push_back(new_msg);
-        return formatted;
-    };
+    //守护进程模式:请求来自unix socket,模式由请求中的mode字段指定
+    if (args.size() == 5) {
+        ControlServer server(engine, args[4]);
+        if (!server.start()) {
+            return -1;
+        }
+        signal(SIGINT, stop_handler);
+        signal(SIGTERM, stop_handler);
+        server.run(g_stop);
+        engine.log_latency();
+        if (runtime.profile_ops) {
+            LOG("%s", profiler.report(false, 0).c_str());
+        }
+        if (Trace::enabled()) {
+            Trace::write(runtime.trace_path);
+        }
+        llama_backend_free();
+        return 0;
+    }
 
-    duration = GetCurrentUS()-start;
-    std::cout << "load model use time:" << duration/1000 << std::endl;
+    // ctrl+C handling
+    {
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+        struct sigaction sigint_action;
+        sigint_action.sa_handler = sigint_handler;
+        sigemptyset (&sigint_action.sa_mask);
+        sigint_action.sa_flags = 0;
+        sigaction(SIGINT, &sigint_action, NULL);
+#elif defined (_WIN32)
+        auto console_ctrl_handler = +[](DWORD ctrl_type) -> BOOL {
+            return (ctrl_type == CTRL_C_EVENT) ? (sigint_handler(SIGINT), true) : false;
+        };
+        SetConsoleCtrlHandler(reinterpret_cast<PHANDLER_ROUTINE>(console_ctrl_handler), true);
+#endif
+    }
 
-    std::string path_session = params.path_prompt_cache;
-    std::vector<llama_token> session_tokens;
-    std::string prompt;
-    //std::vector<llama_token> embd_inp;
-    std::vector<llama_token> embd;
+    //控制台使用第0个会话的两个通道,指令在生成过程中逐条输出.
+    //输入在单独的线程中读取,问答还在输出时也可以输入带"-c"的指令,问答暂停到指令完成后继续;
+    //同一模式的新输入打断(barge-in)还没结束的上一轮,不再等待过时的回答
+    EngineCallbacks ctrl_callbacks;
+    bool first_command = true;
+    ctrl_callbacks.on_token = [](const std::string & piece) {
+        LOG("%s", piece.c_str());//逐字符输出
+    };
+    ctrl_callbacks.on_command = [&](const Iaa_Param_Inter & p) {
+        if (first_command) {
+            std::cout << std::endl << "first action time:" << (GetCurrentUS() - start) / 1000 << std::endl;
+            first_command = false;
+        }
+        print_param(p);
+    };
+    ctrl_callbacks.on_done = [&](const EngineStats & stats) {
+        if (stats.cancelled) {
+            std::cout << std::endl << "control cancelled" << std::endl;
+            return;
+        }
+        if (stats.error) {
+            return;
+        }
+        std::cout << "use time:" << (stats.t_done - stats.t_submit) / 1000 << std::endl;
+        if (strcmp(stats.source, "model") != 0) {
+            std::cout << stats.source << " hit";
+            if (strcmp(stats.source, "semantic") == 0) {
+                std::cout << ": score " << stats.score;
+            }
+            std::cout << std::endl;
+        } else {
+            std::cout << "jump forward tokens:" << stats.n_forced << std::endl;
+            if (stats.early_stop) {
+                std::cout << "early stop saved decode steps:" << stats.n_saved_decode << " (" << stats.n_dropped << " pending tokens)" << std::endl;
+            }
+        }
+        if (runtime.cache) {
+            std::cout << "cache hits:" << engine.command_cache().hits << " misses:" << engine.command_cache().misses << std::endl;
+        }
+    };
+    EngineCallbacks chat_callbacks;
+    chat_callbacks.on_token = ctrl_callbacks.on_token;
+    chat_callbacks.on_done = [](const EngineStats & stats) {
+        if (stats.cancelled) {
+            std::cout << std::endl << "chat cancelled" << std::endl;
+        }
+        if (stats.n_preempted > 0) {
+            std::cout << std::endl << "chat suspended:" << stats.n_preempted << " times, " << stats.suspended_us / 1000 << " ms" << std::endl;
+        }
+    };
 
     //std::vector<int>   input_tokens;  g_input_tokens  = &input_tokens; //暂时不太清楚这几个有什么用,虽然g_*是全局变量,但是注释了好像也没啥影响,先留着
     //std::vector<int>   output_tokens; g_output_tokens = &output_tokens;
     //std::ostringstream output_ss;     g_output_ss     = &output_ss;
-    std::ostringstream assistant_ss; // for storing current assistant message, used in conversation mode
-
-    const int ga_n = params.grp_attn_n; //default 1
-    const int ga_w = params.grp_attn_w; //default 512
 
-    int n_past             = 0;
-    bool unit_mode = false; //false is control,true is chat
-
-    //加载prompt,prompt缓存文件不存在时会自动生成并保存
-    start = GetCurrentUS();
-    if (!path_session.empty()) {
-        if (!file_exists(path_session) || file_is_empty(path_session)) {
-            LOG_INF("%s: session file does not exist or is empty, will create.\n", __func__);
-            chat_add_and_format("system", param_json.ai_prompt);
-            common_chat_templates_inputs inputs;
-            inputs.use_jinja = params.use_jinja;
-            inputs.messages = chat_msgs;
-            inputs.add_generation_prompt = !params.prompt.empty();
-            prompt = common_chat_templates_apply(chat_templates.get(), inputs).prompt;
-
-            LOG_DBG("new prompt is:%s\n", prompt.c_str());
-            session_tokens = common_tokenize(ctx, prompt, true, true);
-            
-            if(session_tokens.size()>=params.n_batch){
-                LOG_ERR("The prompt is too long and has exceeded n_batch, currently n_batch is %d", params.n_batch);
-            }
-            for(int i=0; i<session_tokens.size(); i++){
-                //input_tokens.push_back(session_tokens[i]);
-                common_sampler_accept(smpl, session_tokens[i], /* accept_grammar= */ false);
-            }
-            common_sampler_reset(smpl);
-            for (int i = 0; i < (int) session_tokens.size(); i += params.n_batch) {
-                int n_eval = (int) session_tokens.size() - i;
-                if (n_eval > params.n_batch) {
-                    n_eval = params.n_batch;
-                }
-                if (llama_decode(ctx, llama_batch_get_one(&session_tokens[i], n_eval))) {
-                    LOG_ERR("%s : failed to eval\n", __func__);
-                    return 1;
-                }
-            }
-            n_past = (int) session_tokens.size();
-            llama_state_save_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
-            LOG_INF("saved session to %s\n", path_session.c_str());
-        } else {
-            session_tokens.resize(n_ctx);
-            size_t n_token_count_out = 0;
-            if (!llama_state_load_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.capacity(), &n_token_count_out)) {
-                LOG_ERR("%s: failed to load session file '%s'\n", __func__, path_session.c_str());
-                return -1;
+    std::mutex input_mutex;
+    std::condition_variable input_cv;
+    std::deque<std::string> inputs;
+    std::thread reader([&]() {
+        while (true) {
+            //获取用户输入
+            std::string buffer;
+            std::string line;
+            bool another_line = true;
+            do {
+                another_line = console::readline(line, params.multiline_input); //可以在终端换行,也可以用其它方式获取用户输入
+                buffer += line;
+            } while (another_line);
+
+            if (!buffer.empty() && buffer.back() == '\n') {
+                buffer.pop_back();
             }
-            session_tokens.resize(n_token_count_out);
-            if(n_token_count_out>=params.n_batch){
-                LOG_ERR("The prompt is too long and has exceeded n_batch, currently n_batch is %d", params.n_batch);
-                return -1;
+            if (buffer.empty()) {
+                continue;
             }
-            for(int i=0; i<session_tokens.size(); i++){
-                //input_tokens.push_back(session_tokens[i]);
-                common_sampler_accept(smpl, session_tokens[i], /* accept_grammar= */ false);
+            //同一模式还在生成时立即中断它,正在进行的decode不必跑完
+            engine.request_cancel(0, buffer.find("-c") == std::string::npos);
+            {
+                std::lock_guard<std::mutex> lock(input_mutex);
+                inputs.push_back(buffer);
             }
-            n_past = (int) session_tokens.size();
-            LOG_INF("%s: loaded a session with prompt size of %d tokens\n", __func__, (int)session_tokens.size());
+            input_cv.notify_one();
         }
-        params.n_keep = (int) session_tokens.size(); //重置上下文时至少需保留的tokens
-    }else{
-        LOG_ERR("The prompt file must be provided");
-        return -1;
-    }
-    duration = GetCurrentUS() - start;
-    std::cout << "load prompt use time:" << duration / 1000 << std::endl;
-    // session_tokens的长度不能超过上下文长度,可以在param中设置
-    if ((int) session_tokens.size() > n_ctx - 4) {
-        LOG_ERR("%s: prompt is too long (%d tokens, max %d)\n", __func__, (int) session_tokens.size(), n_ctx - 4);
-        return -1;
-    }
+    });
+    reader.detach();
 
+    bool running = false; //从上次空闲以来是否提交过请求
+    is_interacting = true;
+    LOG_INF("\nuser:");
     while (true) {
-        //获取用户输入
-        if (params.input_prefix_bos) {
-            LOG_DBG("adding input prefix BOS token\n");
-            embd.push_back(llama_vocab_bos(vocab));
-        }
-        LOG_INF("\nuser:");
         std::string buffer;
-        std::string line;
-        bool another_line = true;
-        do {
-            another_line = console::readline(line, params.multiline_input); //可以在终端换行,也可以用其它方式获取用户输入
-            buffer += line;
-        } while (another_line);
-
-        if (buffer.back() == '\n') {
-            buffer.pop_back();
+        {
+            //空闲时等待输入,生成过程中只取走已经输入的内容
+            std::unique_lock<std::mutex> lock(input_mutex);
+            if (engine.idle()) {
+                input_cv.wait(lock, [&] { return !inputs.empty(); });
+            }
+            if (!inputs.empty()) {
+                buffer = inputs.front();
+                inputs.pop_front();
+            }
         }
-        //处理输入数据
         if (!buffer.empty()) {
+            //处理输入数据,带有"-c"的为指令控制模式
             if (params.escape) {
                 string_process_escapes(buffer);
             }
+            bool unit_mode = true; //false is control,true is chat
             size_t pos;
             if((pos=buffer.find("-c"))!=std::string::npos){
                 buffer.erase(pos, 2);
-                buffer = "以下是指令控制模式:" + buffer;
                 unit_mode = false;
-            }else{
-                buffer = "以下是知识问答:" + buffer;
-                unit_mode = true;
             }
-            std::string user_inp = chat_add_and_format("user", std::move(buffer));//此时user_inp会是<|im_start|>user “输入内容” <|im_end|> <|im_start|>assistant
-
-            const auto line_pfx = common_tokenize(ctx, params.input_prefix, false, true);
-            const auto line_inp = common_tokenize(ctx, user_inp,            false, true);
-            const auto line_sfx = common_tokenize(ctx, params.input_suffix, false, true);
-
-            // if (need_insert_eot) {
-            //     llama_token eot = llama_vocab_eot(vocab);
-            //     embd.push_back(eot == LLAMA_TOKEN_NULL ? llama_vocab_eos(vocab) : eot);
-            //     need_insert_eot = false;
-            // }
-
-            embd.insert(embd.end(), line_pfx.begin(), line_pfx.end());
-            embd.insert(embd.end(), line_inp.begin(), line_inp.end());
-            embd.insert(embd.end(), line_sfx.begin(), line_sfx.end());
- 
-            for (size_t i = 0; i < embd.size(); ++i) {
-                const llama_token token = embd[i];
-                const std::string token_str = common_token_to_piece(ctx, token);
-                common_sampler_accept(smpl, token, /* accept_grammar= */ false);
-                //input_tokens.push_back(token);
-                //output_ss << token_str;
+            //barge-in:上一轮被取消,问答历史和前缀的KV保留,新的输入直接接在后面
+            engine.cancel(0, unit_mode);
+            // 开始预测
+            if (!running) {
+                profiler.reset_request();
             }
-            assistant_ss.str("");
+            if (!unit_mode) {
+                first_command = true;
+                start = GetCurrentUS();
+            }
+            is_interacting = false;
+            running = true;
+            engine.submit(0, buffer, unit_mode, unit_mode ? chat_callbacks : ctrl_callbacks);
         }
-        is_interacting = false;
-        common_sampler_reset(smpl);
-        if(!unit_mode){
-            llama_memory_seq_rm(mem, 0, params.n_keep, -1); //从params.n_keep删到最后
-            n_past = params.n_keep;
+        engine.step();
+        if (!running || !engine.idle()) {
+            continue;
         }
-        // 开始预测
-        start = GetCurrentUS();
-        while(!is_interacting){
-            if (!embd.empty()) {
-                int max_embd_size = n_ctx - 4;
-                if ((int) embd.size() > max_embd_size) {
-                    const int skipped_tokens = (int) embd.size() - max_embd_size;
-                    embd.resize(max_embd_size);
-
-                    LOG_WRN("<<input too long: skipped %d token%s>>", skipped_tokens, skipped_tokens != 1 ? "s" : "");
-                }
-
-                if (ga_n == 1 && unit_mode) {
-                    //上下文长度超过之后的处理,从n_keep处开始到中途一半处开始删除,此功能仅会在知识问答模式使用
-                    if (n_past + (int) embd.size() >= n_ctx) {
-                        if (params.n_predict == -2) {
-                            LOG_DBG("\n\n%s: context full and n_predict == -%d => stopping\n", __func__, params.n_predict);
-                            break;
-                        }
-                    
-                        const int n_left    = n_past - params.n_keep;
-                        const int n_discard = n_left/2;
-
-                        LOG_INF("context full, swapping: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n",
-                                n_past, n_left, n_ctx, params.n_keep, n_discard);
-
-                        llama_memory_seq_rm (mem, 0, params.n_keep            , params.n_keep + n_discard); //从bos删到接近n_past的一半
-                        llama_memory_seq_add(mem, 0, params.n_keep + n_discard, n_past, -n_discard);
-                        //LOG_INF("input_token's size is:%ld\n", input_tokens.size());
-                        //LOG_INF("output_tokens's size is:%ld\n", output_tokens.size());
-                        n_past -= n_discard;
-
-                        LOG_INF("after swap: n_past = %d\n", n_past);
-                        LOG_INF("embd: %s\n", string_from(ctx, embd).c_str());
-                    }
-                }
-                
-                //以n_batch为批次开始推理？和后面的embd_inp填充embd有点冲突
-                for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
-                    int n_eval = (int) embd.size() - i;
-                    if (n_eval > params.n_batch) {
-                        n_eval = params.n_batch;
-                    }
-            
-                    LOG_DBG("eval: %s\n", string_from(ctx, embd).c_str());
-                    if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval))) {
-                        LOG_ERR("%s : failed to eval\n", __func__);
-                        return 1;
-                    }
-
-                    n_past += n_eval;
-                }
-            }
-            embd.clear();
-
-            const llama_token id = common_sampler_sample(smpl, ctx, -1); //采样获得的令牌
-            common_sampler_accept(smpl, id, /* accept_grammar= */ true); //如果接受采样获得的令牌,更新采样链等参数
-            embd.push_back(id);
-            //output_tokens.push_back(id);
-            //output_ss << common_token_to_piece(ctx, id, params.special);
-            LOG("%s", common_token_to_piece(ctx, id, params.special).c_str());//逐字符输出
-
-                
-            // 判断是否为结束token
-            if (llama_vocab_is_eog(vocab, common_sampler_last(smpl))) {
-                if (params.interactive) {
-                    if (params.enable_chat_template) {
-                        chat_add_and_format("assistant", assistant_ss.str());
-                        if(!unit_mode){
-                            param_json.pars_control(assistant_ss.str(), result, buffer);
-                            std::cout << std::endl;
-                            for (const auto& p : result) {
-                                std::cout << "[param_name = " << p.name << "] ";
-                                switch (p.value_type) {
-                                    case TYPE_BOOL:
-                                        std::cout << "bool_value = " << p.value.b;
-                                        break;
-                                    case TYPE_INT:
-                                        std::cout << "int_value = " << p.value.i;
-                                        break;
-                                    case TYPE_FLOAT:
-                                        std::cout << "float_value = " << p.value.f;
-                                        break;
-                                    case TYPE_STRING:
-                                        std::cout << "str_value = " << p.value.s;
-                                        break;
-                                }
-                                std::cout << std::endl;
-                            }
-                            duration = GetCurrentUS() - start;
-                            std::cout << "use time:" << duration / 1000 << std::endl;
-                            result.clear();
-                        }
-                    }
-                    is_interacting = true;
-                }
-            }
-            // 如果不是结束符,将token添加进assistant message中
-            assistant_ss << common_token_to_piece(ctx, common_sampler_last(smpl), false);
+        running = false;
+        engine.flush_caches();
+        if (runtime.profile_ops) {
+            LOG("\n%s", profiler.report(true, 10).c_str());
         }
-        //chat_msgs.clear();
+        //控制台没有正常退出的路径,每轮结束后导出一次
+        if (Trace::enabled() && !Trace::write(runtime.trace_path)) {
+            LOG_WRN("%s: failed to write trace to %s\n", __func__, runtime.trace_path.c_str());
+        }
+        is_interacting = true;
+        LOG_INF("\nuser:");
     }
     //common_perf_print(ctx, smpl);
-    common_sampler_free(smpl);
     llama_backend_free();
-    // ggml_threadpool_free_fn(threadpool);
-    //ggml_threadpool_free_fn(threadpool_batch);
 
     return 0;
 }
@@ -0,0 +1,64 @@
+#ifndef BENCH_UTIL
+#define BENCH_UTIL
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+//llm_bench和llm_eval共用的统计工具
+
+//一组样本,单位为毫秒(tok/s等速率类为每秒的数量)
+struct StageSamples{
+    std::string name;
+    std::vector<double> values;
+};
+
+//逗号分隔的整数列表,如"2,4,8"
+static inline std::vector<int> parse_int_list(const char *s){
+    std::vector<int> out;
+    std::string item;
+    for (const char *p = s; ; p++){
+        if (*p == ',' || *p == '\0'){
+            if (!item.empty()) out.push_back(atoi(item.c_str()));
+            item.clear();
+            if (*p == '\0') break;
+        } else {
+            item += *p;
+        }
+    }
+    return out;
+}
+
+//最近秩法求分位数,values需已排序
+static inline double percentile(const std::vector<double> &values, double p){
+    if (values.empty()) return 0;
+    size_t rank = (size_t) (p / 100.0 * values.size() + 0.999999);
+    rank = std::max<size_t>(1, std::min(rank, values.size()));
+    return values[rank - 1];
+}
+
+static inline double mean(const std::vector<double> &values){
+    double sum = 0;
+    for (double v : values) sum += v;
+    return values.empty() ? 0 : sum / values.size();
+}
+
+//输出{"n","mean","p50","p90","p99"},Writer为rapidjson的Writer或PrettyWriter
+template<typename Writer>
+static void write_summary(Writer &w, std::vector<double> values){
+    std::sort(values.begin(), values.end());
+    w.StartObject();
+    w.Key("n");
+    w.Int((int) values.size());
+    w.Key("mean");
+    w.Double(mean(values));
+    w.Key("p50");
+    w.Double(percentile(values, 50));
+    w.Key("p90");
+    w.Double(percentile(values, 90));
+    w.Key("p99");
+    w.Double(percentile(values, 99));
+    w.EndObject();
+}
+
+#endif // BENCH_UTIL
@@ -0,0 +1,258 @@
+#ifndef COMMAND_CACHE
+#define COMMAND_CACHE
+#include <cctype>
+#include <cstdio>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include "param_json.hpp"
+#include "file_hash.hpp"
+
+//控制模式的指令缓存:以归一化后的用户语句和param.json的hash为key,缓存解析后的指令,
+//命中时不需要prefill和decode.按LRU淘汰,可选持久化到磁盘
+class CommandCache{
+public:
+    struct CachedParam{
+        std::string name;
+        IAA_VALUE_TYPE_INTER value_type;
+        float number = 0; //float/bool存为float,与default_param一致
+        int integer = 0;  //int单独保存,超过2^24的整数存为float会丢失精度
+        std::string str;
+    };
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+public:
+    static const int kNormalizeVersion = 2;
+
+    CommandCache(ParamJson &param_json, size_t capacity, const std::string &path)
+        : param_json_(param_json), capacity_(capacity), path_(path){
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) param_json.json_hash);
+        //normalize的规则改变后旧文件中的key不再可信,加上版本号使它们不再命中,按LRU自然淘汰
+        schema_ = std::string(buf) + ".n" + std::to_string(kNormalizeVersion);
+        if (!path_.empty()) load();
+    }
+
+    ~CommandCache(){ flush(); }
+
+    //去掉空白和不影响取值的标点,全角字符转半角,英文转小写.
+    //紧挨数字的'-'、'+'、'.'属于数值的一部分需要保留,否则"调到-10"与"调到10"、"0.95"与"095"会得到同一个key
+    static std::string normalize(const std::string &utterance){
+        //先解码为码点(全角已转半角),再根据前后字符决定是否保留
+        std::vector<uint32_t> cps;
+        std::vector<std::pair<size_t, size_t>> spans; //每个码点在utterance中的起始位置和字节数
+        size_t i = 0;
+        while (i < utterance.size()){
+            unsigned char c = utterance[i];
+            size_t n = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 1;
+            if (i + n > utterance.size()) n = utterance.size() - i;
+            uint32_t cp = c;
+            if (n == 2) cp = ((c & 0x1f) << 6) | (utterance[i + 1] & 0x3f);
+            else if (n == 3) cp = ((c & 0x0f) << 12) | ((utterance[i + 1] & 0x3f) << 6) | (utterance[i + 2] & 0x3f);
+            //全角ASCII(U+FF01~U+FF5E)转半角,全角空格转空格
+            if (cp >= 0xff01 && cp <= 0xff5e) cp -= 0xfee0;
+            else if (cp == 0x3000) cp = ' ';
+            cps.push_back(cp);
+            spans.push_back(std::make_pair(i, n));
+            i += n;
+        }
+        auto is_digit = [&cps](size_t k){ return k < cps.size() && cps[k] < 0x80 && isdigit(cps[k]); };
+        std::string out;
+        for (size_t k = 0; k < cps.size(); k++){
+            const uint32_t cp = cps[k];
+            if (cp < 0x80){
+                //符号和小数点后面紧跟数字(或"-.5"这样的小数)时保留
+                const bool numeric = (cp == '-' || cp == '+' || cp == '.') &&
+                                     (is_digit(k + 1) || (cp != '.' && k + 1 < cps.size() && cps[k + 1] == '.' && is_digit(k + 2)));
+                if (numeric || (!isspace(cp) && !ispunct(cp))) out += (char) tolower(cp);
+            }
+            //中文标点:、。〈〉《》「」『』【】〔〕 以及 ‘’“”…
+            else if (!((cp >= 0x3001 && cp <= 0x3003) || (cp >= 0x3008 && cp <= 0x3011) || (cp >= 0x2018 && cp <= 0x201d) || cp == 0x2026)){
+                out.append(utterance, spans[k].first, spans[k].second);
+            }
+        }
+        return out;
+    }
+
+    bool lookup(const std::string &utterance, std::vector<Iaa_Param_Inter> &result){
+        auto it = index_.find(key(utterance));
+        if (it == index_.end()){
+            misses++;
+            return false;
+        }
+        hits++;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        materialize(param_json_, it->second->second, result);
+        return true;
+    }
+
+    //只标记为已修改,文件由flush()写入,不在请求的路径上序列化整个缓存
+    void insert(const std::string &utterance, const std::vector<Iaa_Param_Inter> &result){
+        put(key(utterance), to_cached(result));
+        dirty_ = !path_.empty();
+    }
+
+    //有修改时写回文件,由引擎在空闲时调用,析构时也会调用
+    void flush(){
+        if (!dirty_) return;
+        save();
+        dirty_ = false;
+    }
+
+    //Iaa_Param_Inter中的字符串指针不归缓存所有,存入缓存前转换为自带存储的CachedParam
+    static std::vector<CachedParam> to_cached(const std::vector<Iaa_Param_Inter> &result){
+        std::vector<CachedParam> params;
+        for (const auto &p : result){
+            CachedParam c;
+            c.name = p.name;
+            c.value_type = p.value_type;
+            c.number = p.value_type == TYPE_BOOL ? (float) p.value.b : p.value_type == TYPE_FLOAT ? p.value.f : 0.0f;
+            if (p.value_type == TYPE_INT) c.integer = p.value.i;
+            if (p.value_type == TYPE_STRING) c.str = p.value.s;
+            params.push_back(c);
+        }
+        return params;
+    }
+
+    static void materialize(ParamJson &param_json, const std::vector<CachedParam> &params, std::vector<Iaa_Param_Inter> &result){
+        for (const auto &c : params){
+            Iaa_Param_Inter p;
+            p.name = param_json.param_name(c.name);
+            p.value_type = c.value_type;
+            switch (c.value_type){
+                case TYPE_BOOL: p.value.b = c.number != 0; break;
+                case TYPE_INT: p.value.i = c.integer; break;
+                case TYPE_FLOAT: p.value.f = c.number; break;
+                case TYPE_STRING: p.value.s = param_json.string_value(c.name, c.str); break;
+            }
+            result.push_back(p);
+        }
+    }
+
+    static void write_commands(rapidjson::Writer<rapidjson::StringBuffer> &writer, const std::vector<CachedParam> &params){
+        writer.StartArray();
+        for (const auto &c : params){
+            writer.StartObject();
+            writer.Key("name");
+            writer.String(c.name.c_str());
+            writer.Key("type");
+            writer.Int(c.value_type);
+            writer.Key("value");
+            if (c.value_type == TYPE_STRING) writer.String(c.str.c_str());
+            else if (c.value_type == TYPE_INT) writer.Int(c.integer);
+            else writer.Double(c.number);
+            writer.EndObject();
+        }
+        writer.EndArray();
+    }
+
+    //文件可能被手工修改或损坏,任何一条指令的字段类型不对时整组作废,避免只回放其中的一部分
+    static bool read_commands(const rapidjson::Value &commands, std::vector<CachedParam> &params){
+        params.clear();
+        if (!commands.IsArray()) return false;
+        for (const auto &c : commands.GetArray()){
+            if (!c.IsObject() || !c.HasMember("name") || !c.HasMember("type") || !c.HasMember("value")) return false;
+            const rapidjson::Value &name = c["name"], &type = c["type"], &value = c["value"];
+            if (!name.IsString() || !type.IsInt() || type.GetInt() < TYPE_INT || type.GetInt() > TYPE_STRING) return false;
+            CachedParam p;
+            p.name = name.GetString();
+            p.value_type = static_cast<IAA_VALUE_TYPE_INTER>(type.GetInt());
+            switch (p.value_type){
+                case TYPE_INT:
+                    if (!value.IsInt()) return false;
+                    p.integer = value.GetInt();
+                    break;
+                case TYPE_FLOAT:
+                case TYPE_BOOL:
+                    if (!value.IsNumber()) return false;
+                    p.number = value.GetFloat();
+                    break;
+                case TYPE_STRING:
+                    if (!value.IsString()) return false;
+                    p.str = value.GetString();
+                    break;
+            }
+            params.push_back(p);
+        }
+        return true;
+    }
+
+    size_t size() const { return entries_.size(); }
+
+private:
+    typedef std::pair<std::string, std::vector<CachedParam>> Entry;
+
+    std::string key(const std::string &utterance) const{
+        return schema_ + "|" + normalize(utterance);
+    }
+
+    void put(const std::string &k, const std::vector<CachedParam> &params){
+        auto it = index_.find(k);
+        if (it != index_.end()){
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+        entries_.push_front(Entry(k, params));
+        index_[k] = entries_.begin();
+        while (entries_.size() > capacity_){
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+
+    //文件中按从旧到新的顺序保存,加载时依次插入即可恢复LRU顺序
+    void load(){
+        std::ifstream file(path_);
+        if (!file.is_open()) return;
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        rapidjson::Document doc;
+        if (doc.Parse(buffer.str().c_str()).HasParseError() || !doc.IsArray()){
+            std::cerr << "指令缓存文件解析失败,忽略: " << path_ << std::endl;
+            return;
+        }
+        for (const auto &e : doc.GetArray()){
+            if (!e.IsObject() || !e.HasMember("key") || !e.HasMember("commands") || !e["key"].IsString() || !e["commands"].IsArray()) continue;
+            std::vector<CachedParam> params;
+            if (read_commands(e["commands"], params)) put(e["key"].GetString(), params);
+        }
+    }
+
+    void save() const{
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+        writer.StartArray();
+        for (auto it = entries_.rbegin(); it != entries_.rend(); ++it){
+            writer.StartObject();
+            writer.Key("key");
+            writer.String(it->first.c_str());
+            writer.Key("commands");
+            write_commands(writer, it->second);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        //先写临时文件再替换,写到一半时进程退出也不会破坏原来的文件
+        const std::string tmp = temp_path(path_, this);
+        std::ofstream file(tmp, std::ios::out | std::ios::trunc);
+        if (!file.is_open()) return;
+        file << sb.GetString();
+        file.close();
+        std::rename(tmp.c_str(), path_.c_str());
+    }
+
+    ParamJson &param_json_;
+    size_t capacity_;
+    std::string path_;
+    std::string schema_;
+    bool dirty_ = false; //有还没有写回文件的修改
+    std::list<Entry> entries_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+};
+
+#endif // COMMAND_CACHE
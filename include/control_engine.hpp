@@ -0,0 +1,971 @@
+#ifndef CONTROL_ENGINE
+#define CONTROL_ENGINE
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "sampling.h"
+#include "llama.h"
+#include "chat.h"
+#include "log.h"
+#include "param_json.hpp"
+#include "control_grammar.hpp"
+#include "control_stream.hpp"
+#include "command_cache.hpp"
+#include "semantic_cache.hpp"
+#include "trace.hpp"
+#include "op_profiler.hpp"
+#include "thread_pools.hpp"
+#include "prompt_cache.hpp"
+#include "bench_util.hpp"
+
+//KV缓存中的序列划分:两种模式的system prompt前缀各占一个序列,之后每个会话各占一个工作序列
+static const llama_seq_id kSeqCtrl = 0;
+static const llama_seq_id kSeqChat = 1;
+static const llama_seq_id kSeqWork = 2; //第一个会话的序列
+static const int kSeqPerSession = 2;     //每个会话两个通道各占一个序列:kSeqWork+2i为控制模式的临时序列,kSeqWork+2i+1为问答历史
+
+inline double GetCurrentUS() { return Trace::now_us(); }
+
+//一轮请求的统计,时间均为GetCurrentUS()的微秒值
+struct EngineStats{
+    const char *source = "model"; //model/rules/cache/semantic
+    double t_submit = 0;
+    double t_first_token = 0;
+    double t_first_command = 0;
+    double t_done = 0;
+    //各阶段耗时(微秒),llama_decode的耗时计入同一批次中的每个会话
+    double prefix_us = 0;   //从前缀序列复制工作序列
+    double tokenize_us = 0; //格式化和分词
+    double prefill_us = 0;  //采样第一个token之前的decode
+    double decode_us = 0;   //之后每个token的decode
+    int n_decode = 0;       //decode的次数,jump-forward补全的token与采样的token在同一次decode中
+    double parse_us = 0;    //流式JSON解析和pars_control
+    int n_prompt = 0;   //本轮送入的prompt token数
+    int n_sampled = 0;  //采样得到的token数
+    int n_forced = 0;   //jump-forward补全的token数
+    bool early_stop = false;
+    int n_dropped = 0;  //提前结束时没有decode就丢弃的token数
+    int n_saved_decode = 0; //提前结束省去的decode次数
+    float score = 0.0f; //语义缓存命中时的相似度
+    bool error = false;
+    bool cancelled = false;
+    double suspended_us = 0; //问答模式被控制模式抢占而暂停的总时长
+    int n_preempted = 0;     //被抢占的次数
+};
+
+//每轮请求的回调,均在step()所在的线程中调用
+struct EngineCallbacks{
+    std::function<void(const std::string &piece)> on_token;
+    std::function<void(const Iaa_Param_Inter &p)> on_command;
+    std::function<void(const EngineStats &stats)> on_done;
+};
+
+//将tokens以n_batch为批次送入指定序列,位置从n_past开始,只输出最后一个token的logits;
+//progress不为空时每批之后以(已送入数, 总数)调用
+static bool decode_seq(llama_context * ctx, llama_batch & batch, const llama_token * tokens, int n_tokens, int n_batch, int & n_past, llama_seq_id seq_id,
+                       const std::function<void(int, int)> & progress = nullptr) {
+    for (int i = 0; i < n_tokens; i += n_batch) {
+        const int n_eval = std::min(n_tokens - i, n_batch);
+        TraceScope trace("llama_decode", "n_tokens", n_eval);
+        common_batch_clear(batch);
+        for (int j = 0; j < n_eval; j++) {
+            common_batch_add(batch, tokens[i + j], n_past + j, { seq_id }, i + j == n_tokens - 1);
+        }
+        if (llama_decode(ctx, batch)) {
+            return false;
+        }
+        n_past += n_eval;
+        if (progress) progress(i + n_eval, n_tokens);
+    }
+    return true;
+}
+
+//多会话的推理引擎:所有会话共享一个模型和一个上下文,每个会话有控制和问答两个通道,各占一个KV序列,
+//每次step()把所有活动通道的prefill分块和decode token拼成一个llama_batch,只调用一次llama_decode.
+//两级调度:控制模式为前台,有控制模式的请求时只调度控制通道,问答通道暂停(状态保留在通道中),控制请求全部结束后继续
+class ControlEngine{
+public:
+    //一轮问答(用户输入和模型回答)在问答序列中的起始位置和在msgs中的起始下标,上下文满时按轮整体淘汰
+    struct ChatTurn{
+        int pos = 0;
+        size_t msg = 0;
+    };
+
+    //一个会话的一个通道
+    struct Session{
+        int id = 0;               //所属会话
+        bool chat = false;        //false为指令控制通道,true为知识问答通道
+        llama_seq_id seq_id = kSeqWork; //控制通道每轮从kSeqCtrl复制,结束后清空;问答通道保存问答历史
+        common_sampler *smpl = nullptr; //控制通道的采样器带有语法约束
+        std::unique_ptr<ControlStreamParser> parser;
+        std::vector<Iaa_Param_Inter> result; //本轮解析出的指令
+        std::vector<common_chat_msg> msgs;   //控制通道为本轮的消息,问答通道为问答历史
+        bool has_history = false; //问答序列中是否保留着之前的问答历史
+        std::vector<ChatTurn> chat_turns; //问答序列中从旧到新的各轮,最后一个为当前轮
+        bool active = false;
+        double t_suspended = 0;   //问答通道本次被暂停的时刻,0表示没有暂停
+        std::string utterance;    //用户原始语句
+        std::string user_str;     //加上模式前缀后的语句,用于command_clean
+        std::string assistant;    //本轮模型的输出
+        std::vector<llama_token> pending; //等待decode的token,全部送入后采样下一个token;问答通道一轮结束后保留最后的EOG
+        size_t n_fed = 0;         //pending中已经送入的数量
+        int n_past = 0;           //序列的长度(self-extend时为压缩后的位置)
+        int n_keep = 0;           //重置上下文时至少需保留的tokens
+        int n_kv = 0;             //序列占用的KV单元数,不启用self-extend时与n_past相同
+        int ga_n = 1;             //本轮模式的self-extend配置
+        int ga_w = 512;
+        int ga_i = 0;             //前缀之后已分组的历史压缩后的长度
+        int n_eval = 0;           //本次step中该会话送入的token数
+        int i_batch = -1;         //本次step中该会话的logits在batch中的下标,-1表示pending还没有全部送入
+        bool has_query = false;   //embd_query中是否为本轮语句的embedding
+        std::vector<float> embd_query;
+        EngineCallbacks cb;
+        EngineStats stats;
+    };
+
+    std::vector<llama_token> ctrl_tokens; //控制模式system prompt的token,常驻kSeqCtrl
+    std::vector<llama_token> chat_tokens; //问答模式system prompt的token,常驻kSeqChat
+
+public:
+    //params.n_parallel为序列总数,会话数为(n_parallel-kSeqWork)/kSeqPerSession.
+    //上下文需以params.kv_unified创建:所有序列共用一个KV缓存,复制的前缀共享同一批单元,
+    //每个会话的预算n_ctx_seq_按 (n_ctx-前缀单元数)/会话数 计算;不统一时每个序列只有n_ctx/n_parallel,按这个预算会超出容量
+    ControlEngine(common_params &params, llama_model *model, llama_context *ctx, ParamJson &param_json)
+        : params_(params), model_(model), ctx_(ctx), param_json_(param_json), runtime_(param_json.runtime),
+          grammar_(param_json), command_cache_(param_json, runtime_.cache_capacity, runtime_.cache ? runtime_.cache_path : ""){
+        mem_ = llama_get_memory(ctx);
+        vocab_ = llama_model_get_vocab(model);
+        n_ctx_ = llama_n_ctx(ctx);
+        n_batch_ = std::min((int) llama_n_batch(ctx), params.n_batch);
+        batch_ = llama_batch_init(n_batch_, 0, 1);
+        sessions_.resize(kSeqPerSession * std::max(1, (params.n_parallel - (int) kSeqWork) / kSeqPerSession));
+        cancel_requested_.reset(new std::atomic<bool>[sessions_.size()]);
+        for (size_t i = 0; i < sessions_.size(); i++) cancel_requested_[i].store(false);
+        llama_set_abort_callback(ctx_, abort_callback, this);
+        //前缀还没有加载,先按 n_ctx/会话数 限制前缀的长度,init中扣除前缀后再确定
+        n_ctx_seq_ = n_ctx_ / n_sessions();
+    }
+
+    ~ControlEngine(){
+        llama_set_abort_callback(ctx_, nullptr, nullptr);
+        for (auto &s : sessions_){
+            if (s.smpl) common_sampler_free(s.smpl);
+        }
+        llama_batch_free(batch_);
+        semantic_cache_.reset();
+        if (embd_ctx_) llama_free(embd_ctx_);
+        if (embd_model_ && embd_model_ != model_) llama_model_free(embd_model_);
+    }
+
+    //创建各通道的采样器,并加载两种模式的system prompt前缀.path_session为prompt缓存文件,
+    //多个引擎(如不同的schema)共用一个文件时用tag区分各自的前缀
+    bool init(const std::string &path_session, const std::string &tag = ""){
+        if (!params_.kv_unified){
+            LOG_ERR("%s: the context must be created with kv_unified, the per-session context budget assumes shared prefix cells\n", __func__);
+            return false;
+        }
+        chat_templates_ = common_chat_templates_init(model_, params_.chat_template);
+        has_model_hash_ = model_fingerprint(params_.model.path, model_hash_);
+        if (!has_model_hash_){
+            LOG_WRN("%s: failed to fingerprint model '%s', the prompt cache will not be used\n", __func__, params_.model.path.c_str());
+        }
+        common_params_sampling sparams_ctrl = params_.sampling;
+        sparams_ctrl.grammar = grammar_.gbnf;
+        for (size_t i = 0; i < sessions_.size(); i++){
+            Session &s = sessions_[i];
+            s.id = (int) i / kSeqPerSession;
+            s.chat = i % kSeqPerSession == 1;
+            s.seq_id = kSeqWork + (llama_seq_id) i;
+            s.smpl = common_sampler_init(model_, s.chat ? params_.sampling : sparams_ctrl);
+            if (!s.smpl){
+                LOG_ERR("%s: failed to initialize sampling subsystem\n", __func__);
+                LOG_DBG("control grammar:\n%s\n", grammar_.gbnf.c_str());
+                return false;
+            }
+            if (s.chat) continue;
+            s.parser.reset(new ControlStreamParser(param_json_, [this, &s](const Iaa_Param_Inter &p){
+                if (s.result.empty()) s.stats.t_first_command = GetCurrentUS();
+                s.result.push_back(p);
+                if (s.cb.on_command) s.cb.on_command(p);
+            }));
+        }
+        if (path_session.empty()){
+            LOG_ERR("The prompt file must be provided");
+            return false;
+        }
+        PromptCache cache(path_session);
+        const std::string prefix = tag.empty() ? "" : tag + "/";
+        if (!load_prefix(cache, prefix + "control", kSeqCtrl, param_json_.ai_control, ctrl_tokens)){
+            return false;
+        }
+        if (strcmp(param_json_.ai_chat, param_json_.ai_control) == 0){
+            //两种模式共用同一个prompt时直接复制前缀
+            llama_memory_seq_cp(mem_, kSeqCtrl, kSeqChat, -1, -1);
+            chat_tokens = ctrl_tokens;
+        } else if (!load_prefix(cache, prefix + "chat", kSeqChat, param_json_.ai_chat, chat_tokens)){
+            return false;
+        }
+        //各会话共享前缀所在的KV单元,剩余的单元平均分配,同一会话的两个通道共用一份
+        const int n_prefix_cells = (int) ctrl_tokens.size() + (strcmp(param_json_.ai_chat, param_json_.ai_control) == 0 ? 0 : (int) chat_tokens.size());
+        n_ctx_seq_ = (n_ctx_ - n_prefix_cells) / n_sessions();
+        if (n_ctx_seq_ <= 4){
+            LOG_ERR("%s: no context left for the sessions: n_ctx = %d, prefix cells = %d, sessions = %d\n", __func__, n_ctx_, n_prefix_cells, n_sessions());
+            return false;
+        }
+        init_semantic();
+        return true;
+    }
+
+    int n_sessions() const { return (int) sessions_.size() / kSeqPerSession; }
+    //会话的任一通道正在处理请求
+    bool busy(int sid) const { return busy(sid, false) || busy(sid, true); }
+    bool busy(int sid, bool chat) const { return sessions_[lane(sid, chat)].active; }
+    const CommandCache &command_cache() const { return command_cache_; }
+    //把指令缓存的修改写回文件,在没有请求进行时调用
+    void flush_caches(){ command_cache_.flush(); }
+    const common_chat_templates *chat_templates() const { return chat_templates_.get(); }
+    //profiler需已通过install()安装在创建ctx的参数上,引擎负责告知每次decode属于prefill还是decode
+    void set_profiler(OpProfiler *profiler){ profiler_ = profiler; }
+    //分开的prefill/decode线程池,每次decode前暂停本次用不到的那个
+    void set_thread_pools(ThreadPools *pools){ pools_ = pools; }
+
+    //按类别统计的延迟(毫秒),first_ms对控制模式为第一条指令,对问答模式为第一个token
+    struct ClassLatency{
+        std::vector<double> first_ms;
+        std::vector<double> total_ms;
+        std::vector<double> suspended_ms; //被控制模式抢占而暂停的时长
+        int n_preempted = 0;              //被抢占过的轮数
+    };
+    static const size_t kLatencyWindow = 1024;
+
+    const ClassLatency &latency(bool chat) const { return latency_[chat ? 1 : 0]; }
+
+    //打印两类请求的延迟分位数
+    void log_latency() const{
+        for (int c = 0; c < 2; c++){
+            const ClassLatency &l = latency_[c];
+            if (l.total_ms.empty()) continue;
+            std::vector<double> first = l.first_ms, total = l.total_ms, suspended = l.suspended_ms;
+            std::sort(first.begin(), first.end());
+            std::sort(total.begin(), total.end());
+            std::sort(suspended.begin(), suspended.end());
+            LOG_INF("%s latency over %d requests: first %s p50 %.1f p90 %.1f p99 %.1f ms, total p50 %.1f p90 %.1f p99 %.1f ms",
+                    c ? "chat" : "control", (int) total.size(), c ? "token" : "command",
+                    percentile(first, 50), percentile(first, 90), percentile(first, 99),
+                    percentile(total, 50), percentile(total, 90), percentile(total, 99));
+            if (c) LOG_INF(", preempted %d, suspended p50 %.1f p99 %.1f ms", l.n_preempted, percentile(suspended, 50), percentile(suspended, 99));
+            LOG_INF("\n");
+        }
+    }
+
+    bool idle() const{
+        for (const auto &s : sessions_){
+            if (s.active) return false;
+        }
+        return true;
+    }
+
+    //提交一轮请求到会话对应模式的通道,该通道正忙时返回false.规则/缓存命中时在返回前就已经调用了全部回调.
+    //问答正在生成时也可以提交控制模式的请求,问答在它结束前暂停
+    bool submit(int sid, const std::string &utterance, bool chat, const EngineCallbacks &cb){
+        if (sid < 0 || sid >= n_sessions() || busy(sid, chat)) return false;
+        TraceScope trace("submit", "session", sid);
+        Session &s = sessions_[lane(sid, chat)];
+        cancel_requested_[lane(sid, chat)].store(false);
+        s.cb = cb;
+        s.stats = EngineStats();
+        s.stats.t_submit = GetCurrentUS();
+        s.t_suspended = 0;
+        s.utterance = utterance;
+        s.result.clear();
+        s.has_query = false;
+        if (!chat && fast_path(s)) return true;
+
+        std::string buffer = (chat ? "以下是知识问答:" : "以下是指令控制模式:") + utterance;
+        //控制通道每轮从控制前缀复制一个临时序列;问答通道在自己的序列上延续历史,没有历史时才从问答前缀开始.
+        //两种模式交替时前缀和问答历史都不需要重新prefill
+        double t0 = GetCurrentUS();
+        s.n_keep = (int) (chat ? chat_tokens : ctrl_tokens).size();
+        const GroupAttnConfig &ga = chat ? runtime_.chat_group_attn : runtime_.control_group_attn;
+        s.ga_n = ga.n;
+        s.ga_w = ga.w;
+        //问答历史的n_past、n_kv、ga_i和上一轮留下的EOG都保存在通道中,直接延续
+        if (!chat || !s.has_history){
+            TraceScope trace_prefix("prefix_restore");
+            llama_memory_seq_rm(mem_, s.seq_id, -1, -1);
+            llama_memory_seq_cp(mem_, chat ? kSeqChat : kSeqCtrl, s.seq_id, -1, -1);
+            s.n_past = s.n_keep;
+            s.n_kv = s.n_keep;
+            s.ga_i = 0;
+            s.pending.clear();
+            common_chat_msg system_msg;
+            system_msg.role = "system";
+            system_msg.content = chat ? param_json_.ai_chat : param_json_.ai_control;
+            s.msgs.clear();
+            s.msgs.push_back(system_msg);
+            if (chat){
+                s.has_history = true;
+                s.chat_turns.clear();
+            }
+        }
+        if (chat){
+            //上一轮留下的EOG属于上一轮的回答
+            ChatTurn turn;
+            turn.pos = s.n_past + (int) s.pending.size();
+            turn.msg = s.msgs.size();
+            s.chat_turns.push_back(turn);
+        }
+        double t1 = GetCurrentUS();
+        s.stats.prefix_us = t1 - t0;
+        if (params_.input_prefix_bos){
+            s.pending.push_back(llama_vocab_bos(vocab_));
+        }
+        const std::string user_inp = chat_add_and_format(s, "user", buffer); //<|im_start|>user “输入内容” <|im_end|> <|im_start|>assistant
+        const auto line_pfx = tokenize(params_.input_prefix);
+        const auto line_inp = tokenize(user_inp);
+        const auto line_sfx = tokenize(params_.input_suffix);
+        s.pending.insert(s.pending.end(), line_pfx.begin(), line_pfx.end());
+        s.pending.insert(s.pending.end(), line_inp.begin(), line_inp.end());
+        s.pending.insert(s.pending.end(), line_sfx.begin(), line_sfx.end());
+        const int max_embd_size = n_ctx_seq_ - 4;
+        if ((int) s.pending.size() > max_embd_size){
+            const int skipped_tokens = (int) s.pending.size() - max_embd_size;
+            s.pending.resize(max_embd_size);
+            LOG_WRN("<<input too long: skipped %d token%s>>", skipped_tokens, skipped_tokens != 1 ? "s" : "");
+        }
+        s.n_fed = 0;
+        s.stats.tokenize_us = GetCurrentUS() - t1;
+        s.stats.n_prompt = (int) s.pending.size();
+        s.user_str = buffer;
+        s.assistant.clear();
+        if (!chat) s.parser->reset(buffer);
+        common_sampler_reset(s.smpl);
+        s.active = true;
+        return true;
+    }
+
+    //取消会话一个通道正在进行的一轮,已输出的指令保持不变,on_done中cancelled为true.需在step()所在的线程中调用.
+    //问答通道撤销本轮写入的KV和消息,之前的历史保留;控制模式的临时序列直接清空,下一轮仍从常驻的前缀复制
+    void cancel(int sid, bool chat){
+        if (sid < 0 || sid >= n_sessions() || !busy(sid, chat)) return;
+        Session &s = sessions_[lane(sid, chat)];
+        s.active = false;
+        if (s.chat){
+            rollback_turn(s);
+        } else {
+            llama_memory_seq_rm(mem_, s.seq_id, -1, -1);
+            s.pending.clear();
+        }
+        s.n_fed = 0;
+        s.stats.cancelled = true;
+        s.stats.t_done = GetCurrentUS();
+        resume(s, s.stats.t_done);
+        trace_request(s);
+        if (s.cb.on_done) s.cb.on_done(s.stats);
+    }
+
+    //取消会话两个通道的请求
+    void cancel(int sid){
+        cancel(sid, false);
+        cancel(sid, true);
+    }
+
+    //请求取消会话一个通道的本轮,可以在其它线程或信号处理函数中调用.正在进行的llama_decode包含该通道时
+    //由abort回调中断,取消在下一次step()中完成;请求只对当前这一轮有效,submit时清除
+    void request_cancel(int sid, bool chat){
+        if (sid < 0 || sid >= n_sessions()) return;
+        cancel_requested_[lane(sid, chat)].store(true);
+    }
+
+    void request_cancel(int sid){
+        request_cancel(sid, false);
+        request_cancel(sid, true);
+    }
+
+    //执行一次llama_decode并为完成送入的通道采样,没有活动通道时返回false
+    bool step(){
+        apply_cancel_requests();
+        common_batch_clear(batch_);
+        std::vector<Session *> in_batch;
+        //有控制请求时只调度控制通道,问答通道暂停到控制请求全部结束,保证指令的首个token不被长回答拖慢
+        bool foreground = false;
+        for (const auto &s : sessions_){
+            foreground = foreground || (s.active && !s.chat);
+        }
+        const double now = GetCurrentUS();
+        //先放decode阶段(pending很短)的通道,剩余的预算按轮转顺序分给prefill的通道
+        std::vector<Session *> order;
+        for (size_t k = 0; k < sessions_.size(); k++){
+            Session &s = sessions_[(next_ + k) % sessions_.size()];
+            if (!s.active) continue;
+            if (s.chat && foreground){
+                if (s.t_suspended == 0){
+                    s.t_suspended = now;
+                    s.stats.n_preempted++;
+                }
+                continue;
+            }
+            resume(s, now);
+            order.push_back(&s);
+        }
+        if (order.empty()) return false;
+        next_ = (next_ + 1) % sessions_.size();
+        std::stable_sort(order.begin(), order.end(), [](const Session *a, const Session *b){
+            return a->pending.size() - a->n_fed < b->pending.size() - b->n_fed;
+        });
+        for (Session *s : order){
+            const int budget = n_batch_ - batch_.n_tokens;
+            if (budget <= 0) break;
+            if (!make_room(*s)){
+                //问答通道撤销没能送入的本轮,保持历史与KV一致;控制通道按已有的输出结束
+                if (s->chat){
+                    drop_turn(*s);
+                } else {
+                    finish(*s);
+                }
+                continue;
+            }
+            const int n_left = (int) (s->pending.size() - s->n_fed);
+            s->n_eval = std::min(n_left, budget);
+            for (int j = 0; j < s->n_eval; j++){
+                common_batch_add(batch_, s->pending[s->n_fed + j], s->n_past + j, { s->seq_id }, j == n_left - 1);
+            }
+            s->i_batch = s->n_eval == n_left ? batch_.n_tokens - 1 : -1;
+            in_batch.push_back(s);
+        }
+        if (in_batch.empty()) return true;
+        if (profiler_){
+            bool prefill = false;
+            for (Session *s : in_batch) prefill = prefill || s->stats.n_sampled == 0;
+            profiler_->set_phase(prefill);
+        }
+        if (pools_) pools_->prepare(batch_.n_tokens > 1);
+        const double t_decode = GetCurrentUS();
+        int ret;
+        for (Session *s : in_batch) batch_lanes_.push_back((size_t) (s->seq_id - kSeqWork));
+        {
+            TraceScope trace("llama_decode", "n_tokens", batch_.n_tokens);
+            ret = llama_decode(ctx_, batch_);
+        }
+        batch_lanes_.clear();
+        const double dt = GetCurrentUS() - t_decode;
+        for (Session *s : in_batch){
+            if (s->stats.n_sampled == 0){
+                s->stats.prefill_us += dt;
+            } else {
+                s->stats.decode_us += dt;
+                s->stats.n_decode++;
+            }
+        }
+        if (ret == 2){
+            //被abort回调中断:llama.cpp只删除了中断的那个ubatch写入的KV,这里删除整个batch写入的部分,
+            //被取消的通道在这里结束,其余通道的状态不变,下一次step重新送入
+            LOG_DBG("%s: decode aborted by cancel request\n", __func__);
+            for (Session *s : in_batch){
+                llama_memory_seq_rm(mem_, s->seq_id, s->n_past, -1);
+            }
+            apply_cancel_requests();
+            return true;
+        }
+        if (ret){
+            LOG_ERR("%s : failed to eval\n", __func__);
+            for (Session *s : in_batch){
+                s->stats.error = true;
+                if (s->chat) reset_history(*s);
+                s->pending.clear();
+                finish(*s);
+            }
+            return true;
+        }
+        for (Session *s : in_batch){
+            s->n_past += s->n_eval;
+            s->n_kv += s->n_eval;
+            s->n_fed += s->n_eval;
+            if (s->i_batch >= 0){
+                s->pending.clear();
+                s->n_fed = 0;
+                sample(*s);
+            }
+        }
+        return true;
+    }
+
+private:
+    //负责根据传入的role和content,按照chat_templates的特殊格式进行组合排列
+    std::string chat_add_and_format(Session &s, const std::string &role, const std::string &content){
+        TraceScope trace("chat_add_and_format");
+        common_chat_msg new_msg;
+        new_msg.role = role;
+        new_msg.content = content;
+        auto formatted = common_chat_format_single(chat_templates_.get(), s.msgs, new_msg, role == "user", false);
+        s.msgs.push_back(new_msg);
+        return formatted;
+    }
+
+    std::vector<llama_token> tokenize(const std::string &text){
+        TraceScope trace("common_tokenize");
+        std::vector<llama_token> tokens = common_tokenize(ctx_, text, false, true);
+        trace.set_arg("n_tokens", (int64_t) tokens.size());
+        return tokens;
+    }
+
+    //加载system prompt并预填充到指定的KV序列.缓存文件的模型、模板和前缀token与当前一致时直接恢复KV,
+    //不存在或不一致(修改了AI_PROMPT、更换了模型)时重新prefill并覆盖缓存文件
+    bool load_prefix(PromptCache &cache, const std::string &name, llama_seq_id seq_id, const char *system_prompt, std::vector<llama_token> &tokens){
+        TraceScope trace("load_prefix", "seq_id", seq_id);
+        std::vector<common_chat_msg> msgs(1);
+        msgs[0].role = "system";
+        msgs[0].content = system_prompt;
+        common_chat_templates_inputs inputs;
+        inputs.use_jinja = params_.use_jinja;
+        inputs.messages = msgs;
+        inputs.add_generation_prompt = !params_.prompt.empty();
+        const std::string prompt = common_chat_templates_apply(chat_templates_.get(), inputs).prompt;
+        LOG_DBG("new prompt is:%s\n", prompt.c_str());
+        tokens = common_tokenize(ctx_, prompt, true, true);
+
+        // 前缀的长度不能超过每个会话的上下文长度,可以超过n_batch
+        if ((int) tokens.size() > n_ctx_seq_ - 4){
+            LOG_ERR("%s: prompt is too long (%d tokens, max %d)\n", __func__, (int) tokens.size(), n_ctx_seq_ - 4);
+            return false;
+        }
+
+        PromptCacheKey key;
+        key.model_hash = model_hash_;
+        const std::string tmpl = std::string(common_chat_templates_source(chat_templates_.get())) +
+                                 (inputs.use_jinja ? "|jinja" : "") + (inputs.add_generation_prompt ? "|gen" : "");
+        key.template_hash = fnv1a(tmpl.data(), tmpl.size());
+        key.prompt_hash = PromptCache::tokens_hash(tokens);
+        key.n_tokens = (uint32_t) tokens.size();
+        std::string reason = "cannot be matched without a model fingerprint";
+        if (has_model_hash_ && cache.load(ctx_, name, seq_id, key, tokens, reason)){
+            LOG_INF("%s: loaded '%s' with prompt size of %d tokens\n", __func__, name.c_str(), (int) tokens.size());
+            return true;
+        }
+        LOG_INF("%s: session file '%s' %s, will rebuild.\n", __func__, cache.path().c_str(), reason.c_str());
+        llama_memory_seq_rm(mem_, seq_id, -1, -1);
+        //按n_ubatch分块prefill,每块的计算缓冲区与一次普通的decode相同,较小的n_batch也能生成较长的前缀
+        const int n_chunk = std::min(n_batch_, (int) llama_n_ubatch(ctx_));
+        const double t_start = GetCurrentUS();
+        int n_prefix = 0;
+        if (!decode_seq(ctx_, batch_, tokens.data(), (int) tokens.size(), n_chunk, n_prefix, seq_id, [&](int done, int total){
+                if (total <= n_chunk) return;
+                const double elapsed = (GetCurrentUS() - t_start) / 1e6;
+                LOG_INF("load_prefix: prefill '%s' %d/%d tokens (%.0f%%), %.1fs elapsed, %.1fs left\n", name.c_str(), done, total,
+                        100.0 * done / total, elapsed, elapsed / done * (total - done));
+            })){
+            LOG_ERR("%s : failed to eval\n", __func__);
+            return false;
+        }
+        if (!has_model_hash_) return true;
+        if (cache.save(ctx_, name, seq_id, key, tokens)){
+            LOG_INF("saved '%s' to %s\n", name.c_str(), cache.path().c_str());
+        } else {
+            LOG_WRN("%s: failed to save '%s' to session file '%s'\n", __func__, name.c_str(), cache.path().c_str());
+        }
+        return true;
+    }
+
+    //语义指令缓存:用单独的embedding上下文(均值池化)计算用户语句的向量,在已验证的 语句->指令 索引中检索
+    void init_semantic(){
+        if (runtime_.semantic_cache_path.empty()) return;
+        embd_model_ = model_;
+        if (!runtime_.semantic_model.empty()){
+            embd_model_ = llama_model_load_from_file(runtime_.semantic_model.c_str(), llama_model_default_params());
+        }
+        if (embd_model_){
+            llama_context_params eparams = llama_context_default_params();
+            eparams.n_ctx = 512;
+            eparams.n_batch = 512;
+            eparams.n_ubatch = 512;
+            eparams.n_threads = params_.cpuparams.n_threads;
+            eparams.n_threads_batch = params_.cpuparams_batch.n_threads;
+            eparams.embeddings = true;
+            eparams.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+            embd_ctx_ = llama_init_from_model(embd_model_, eparams);
+        }
+        if (embd_ctx_){
+            semantic_cache_.reset(new SemanticCache(runtime_.semantic_cache_path, llama_model_n_embd(embd_model_), param_json_.json_hash, runtime_.semantic_capacity));
+        }
+        if (!semantic_cache_ || !semantic_cache_->ok()){
+            LOG_WRN("%s: failed to initialize semantic cache '%s', disabled\n", __func__, runtime_.semantic_cache_path.c_str());
+            semantic_cache_.reset();
+        } else {
+            LOG_INF("%s: semantic cache loaded with %d entries\n", __func__, (int) semantic_cache_->size());
+        }
+    }
+
+    //计算归一化后语句的embedding,结果做L2归一化后存入embd_query
+    bool embed_utterance(const std::string &text, std::vector<float> &embd_query){
+        TraceScope trace("embed_utterance");
+        std::vector<llama_token> tokens = common_tokenize(embd_ctx_, CommandCache::normalize(text), true, true);
+        if (tokens.empty() || tokens.size() > llama_n_batch(embd_ctx_)){
+            return false;
+        }
+        llama_memory_clear(llama_get_memory(embd_ctx_), true);
+        llama_batch ebatch = llama_batch_init((int) tokens.size(), 0, 1);
+        for (size_t i = 0; i < tokens.size(); i++){
+            common_batch_add(ebatch, tokens[i], (llama_pos) i, { 0 }, true);
+        }
+        const float *embd_out = llama_decode(embd_ctx_, ebatch) == 0 ? llama_get_embeddings_seq(embd_ctx_, 0) : nullptr;
+        llama_batch_free(ebatch);
+        if (!embd_out){
+            return false;
+        }
+        embd_query.resize(llama_model_n_embd(embd_model_));
+        common_embd_normalize(embd_out, embd_query.data(), (int) embd_query.size(), 2);
+        return true;
+    }
+
+    //控制模式依次尝试规则快速通道、指令缓存和语义缓存,命中时不需要prefill和decode,KV缓存和问答历史也保持不变
+    bool fast_path(Session &s){
+        TraceScope trace("fast_path");
+        const char *source = nullptr;
+        if (runtime_.rules && param_json_.pars_rules(s.utterance, s.result)){
+            source = "rules";
+        }
+        else if (runtime_.cache && command_cache_.lookup(s.utterance, s.result)){
+            source = "cache";
+        }
+        else if (semantic_cache_){
+            //精确缓存未命中时按语义相似度检索.相似度只说明说法相近,数字、枚举值和开关还需与收录的语句一致;
+            //命中的结果不写入精确缓存,避免一次误判被持久化
+            s.has_query = embed_utterance(s.utterance, s.embd_query);
+            if (s.has_query){
+                //按相似度从高到低取第一条取值一致的记录
+                for (const auto &hit : semantic_cache_->search(s.embd_query.data(), runtime_.semantic_threshold)){
+                    rapidjson::Document cached;
+                    std::vector<CommandCache::CachedParam> params;
+                    if (cached.Parse(semantic_cache_->payload(hit.second).c_str()).HasParseError() || !cached.IsObject() ||
+                        !cached.HasMember("u") || !cached["u"].IsString() || !cached.HasMember("c") ||
+                        !CommandCache::read_commands(cached["c"], params) || !same_values(s.utterance, cached["u"].GetString())){
+                        continue;
+                    }
+                    CommandCache::materialize(param_json_, params, s.result);
+                    s.stats.score = hit.first;
+                    source = "semantic";
+                    break;
+                }
+            }
+        }
+        if (!source) return false;
+        s.stats.source = source;
+        s.stats.t_first_command = GetCurrentUS();
+        for (const auto &p : s.result){
+            if (s.cb.on_command) s.cb.on_command(p);
+        }
+        s.stats.t_done = GetCurrentUS();
+        trace_request(s);
+        record_latency(s);
+        if (s.cb.on_done) s.cb.on_done(s.stats);
+        return true;
+    }
+
+    bool same_values(const std::string &a, const std::string &b) const{
+        return param_json_.rules.values(CommandCache::normalize(a)) == param_json_.rules.values(CommandCache::normalize(b));
+    }
+
+    //会话占用的KV单元数,不含共享的前缀:控制通道只在请求进行中占用,问答通道为保留的历史
+    int session_cells(int sid) const{
+        const Session &ctrl = sessions_[lane(sid, false)];
+        const Session &chat = sessions_[lane(sid, true)];
+        return (ctrl.active ? ctrl.n_kv - ctrl.n_keep : 0) + (chat.has_history ? chat.n_kv - chat.n_keep : 0);
+    }
+
+    //丢弃问答通道的全部历史,KV单元立即释放,下一轮从前缀重新开始
+    void reset_history(Session &s){
+        llama_memory_seq_rm(mem_, s.seq_id, -1, -1);
+        s.has_history = false;
+    }
+
+    //超出会话的上下文预算(两个通道合计)时,从问答历史最旧的一轮开始整轮淘汰,控制通道也可以借此腾出空间;
+    //至少腾出一半的历史以减少移位的次数,system prompt(n_keep)始终保留并作为attention sink.
+    //问答开启self-extend时不淘汰历史,位置由self_extend()压缩,KV单元用完时结束本轮
+    bool make_room(Session &s){
+        const int n_left_pending = (int) (s.pending.size() - s.n_fed);
+        if (s.ga_n != 1) self_extend(s);
+        if (session_cells(s.id) + n_left_pending < n_ctx_seq_) return true;
+        Session &chat = sessions_[lane(s.id, true)];
+        if (evict_turns(chat, session_cells(s.id) + n_left_pending - n_ctx_seq_ + 1) &&
+            session_cells(s.id) + n_left_pending < n_ctx_seq_) return true;
+        if (s.ga_n != 1){
+            LOG_WRN("%s: context full with self-extend: n_kv = %d, n_ctx = %d\n", __func__, session_cells(s.id), n_ctx_seq_);
+        }
+        return false;
+    }
+
+    //从最旧的一轮开始淘汰问答通道c的历史,当前轮(最后一轮)不能淘汰
+    bool evict_turns(Session &c, int n_needed){
+        if (!c.has_history || c.ga_n != 1 || c.chat_turns.size() < 2) return false;
+        n_needed = std::max(n_needed, (c.n_past - c.n_keep) / 2);
+        size_t n_turns = 0;
+        while (n_turns + 1 < c.chat_turns.size() && c.chat_turns[n_turns].pos - c.n_keep < n_needed) n_turns++;
+        const int begin = c.n_keep;
+        const int end = c.chat_turns[n_turns].pos;
+        const int n_discard = end - begin;
+        if (n_turns == 0 || n_discard <= 0) return false;
+        LOG_INF("context full, evicting %d turns: n_past = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n",
+                (int) n_turns, c.n_past, n_ctx_seq_, c.n_keep, n_discard);
+        //上一轮的EOG还没有送入时,淘汰的最后一轮有一部分在pending中,直接从pending删除
+        const int end_kv = std::min(end, c.n_past);
+        const int n_unfed = end - end_kv;
+        llama_memory_seq_rm (mem_, c.seq_id, begin, end_kv);
+        llama_memory_seq_add(mem_, c.seq_id, end_kv, c.n_past, begin - end_kv);
+        c.n_past -= end_kv - begin;
+        c.n_kv -= end_kv - begin;
+        c.pending.erase(c.pending.begin() + c.n_fed, c.pending.begin() + c.n_fed + n_unfed);
+        //同步删除对应的消息,保证之后格式化时的历史与KV一致
+        const size_t msg_begin = c.chat_turns[0].msg;
+        const size_t msg_end = c.chat_turns[n_turns].msg;
+        c.msgs.erase(c.msgs.begin() + msg_begin, c.msgs.begin() + msg_end);
+        c.chat_turns.erase(c.chat_turns.begin(), c.chat_turns.begin() + n_turns);
+        for (auto &t : c.chat_turns){
+            t.pos -= n_discard;
+            t.msg -= msg_end - msg_begin;
+        }
+        LOG_INF("after eviction: n_past = %d, %d turns left\n", c.n_past, (int) c.chat_turns.size());
+        return true;
+    }
+
+    //self-extend:与llama.cpp的main相同的分组方式,但只作用于前缀之后的历史(相对位置r=pos-n_keep).
+    //前缀的KV单元与kSeqCtrl/kSeqChat共享,不能改动它们的位置;seq_div按绝对位置整除,
+    //所以先把要分组的窗口移到所有位置之上的M+r(M为ga_n的倍数),整除后得到M/ga_n+r/ga_n,再移回n_keep+r/ga_n
+    void self_extend(Session &s){
+        const int base = s.n_keep;
+        while (s.n_past - base >= s.ga_i + s.ga_w){
+            const int n_past = s.n_past - base;
+            const int ib = (s.ga_n * s.ga_i) / s.ga_w;
+            const int bd = (s.ga_w / s.ga_n) * (s.ga_n - 1);
+            const int dd = (s.ga_w / s.ga_n) - ib * bd - s.ga_w;
+            const int lo = s.ga_i + ib * bd; //要分组的窗口[lo, lo+ga_w),已恢复为未压缩的相对位置
+            const int m = s.ga_n * (s.n_past + ib * bd + s.ga_w);
+            LOG_DBG("self-extend: ga_i = %d, n_past = %d, window [%d, %d) / %d\n", s.ga_i, n_past, lo, lo + s.ga_w, s.ga_n);
+            llama_memory_seq_add(mem_, s.seq_id, base + s.ga_i, base + n_past, ib * bd);
+            llama_memory_seq_add(mem_, s.seq_id, base + lo, base + lo + s.ga_w, m - base);
+            llama_memory_seq_div(mem_, s.seq_id, m + lo, m + lo + s.ga_w, s.ga_n);
+            llama_memory_seq_add(mem_, s.seq_id, (m + lo) / s.ga_n, (m + lo + s.ga_w) / s.ga_n, base - m / s.ga_n);
+            llama_memory_seq_add(mem_, s.seq_id, base + lo + s.ga_w, base + n_past + ib * bd, dd);
+            s.n_past -= bd;
+            s.ga_i += s.ga_w / s.ga_n;
+        }
+    }
+
+    void sample(Session &s){
+        TraceScope trace("sample", "session", s.id);
+        const llama_token id = common_sampler_sample(s.smpl, ctx_, s.i_batch); //采样获得的令牌
+        common_sampler_accept(s.smpl, id, /* accept_grammar= */ true);
+        s.pending.push_back(id);
+        s.stats.n_sampled++;
+        if (s.stats.t_first_token == 0) s.stats.t_first_token = GetCurrentUS();
+        if (s.cb.on_token) s.cb.on_token(common_token_to_piece(ctx_, id, params_.special));
+
+        // EOG在special=false时为空
+        const std::string piece = common_token_to_piece(ctx_, id, false);
+        s.assistant += piece;
+        const bool is_eog = llama_vocab_is_eog(vocab_, id);
+        if (!s.chat){
+            TraceScope trace_parse("parse");
+            const double t_parse = GetCurrentUS();
+            s.parser->feed(piece);
+            s.stats.parse_us += GetCurrentUS() - t_parse;
+        }
+
+        //jump-forward:语法唯一确定的后续内容直接加入pending,下一次step作为一个批次decode
+        if (!s.chat && !is_eog && runtime_.jump_forward){
+            TraceScope trace_jump("jump_forward");
+            const std::string forced = grammar_.jump_forward(s.assistant);
+            //与刚采样的token一起重新分词,使补全的token与模型自己输出时的切分一致:刚采样的token会与补全内容合并时不补全,
+            //最后一个token可能与之后模型输出的内容合并,也留给模型自己生成
+            const auto tokens = forced.empty() ? std::vector<llama_token>() : common_tokenize(ctx_, piece + forced, false, false);
+            if (tokens.size() > 2 && tokens[0] == id){
+                const std::vector<llama_token> forced_tokens(tokens.begin() + 1, tokens.end() - 1);
+                trace_jump.set_arg("n_forced", (int64_t) forced_tokens.size());
+                std::string text;
+                for (const llama_token token : forced_tokens){
+                    common_sampler_accept(s.smpl, token, /* accept_grammar= */ true);
+                    s.pending.push_back(token);
+                    text += common_token_to_piece(ctx_, token, false);
+                }
+                s.stats.n_forced += (int) forced_tokens.size();
+                s.assistant += text;
+                const double t_parse = GetCurrentUS();
+                s.parser->feed(text);
+                s.stats.parse_us += GetCurrentUS() - t_parse;
+                if (s.cb.on_token) s.cb.on_token(text);
+            }
+        }
+
+        //控制模式下JSON闭合(或拒绝语句完整)后提前结束,省去最后一次decode和EOG的采样
+        const bool is_early_stop = !s.chat && !is_eog && s.parser->complete();
+        if (is_eog || is_early_stop){
+            s.stats.early_stop = is_early_stop;
+            finish(s);
+        }
+    }
+
+    void finish(Session &s){
+        s.active = false;
+        if (params_.enable_chat_template){
+            chat_add_and_format(s, "assistant", s.assistant);
+        }
+        if (!s.chat){
+            //指令已在生成过程中逐条输出,这里只处理输出被截断、没有解析出任何指令的情况
+            if (s.parser->emitted() == 0){
+                TraceScope trace_repair("pars_control");
+                const size_t n_before = s.result.size();
+                const double t_parse = GetCurrentUS();
+                param_json_.pars_control(s.assistant, s.result, s.user_str);
+                s.stats.parse_us += GetCurrentUS() - t_parse;
+                for (size_t i = n_before; i < s.result.size(); i++){
+                    if (s.cb.on_command) s.cb.on_command(s.result[i]);
+                }
+            }
+            //只缓存结构完整的输出,被截断的输出下次仍交给模型
+            if (runtime_.cache && s.parser->emitted() > 0){
+                command_cache_.insert(s.utterance, s.result);
+            }
+            //语义缓存只收录不含无效指令的结果,避免把拒绝或误识别扩散到相近的说法上
+            bool verified = s.parser->emitted() > 0;
+            for (const auto &p : s.result){
+                verified = verified && strcmp(p.name, "无效指令") != 0;
+            }
+            if (semantic_cache_ && s.has_query && verified){
+                rapidjson::StringBuffer sb;
+                rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+                writer.StartObject();
+                writer.Key("u");
+                writer.String(s.utterance.c_str());
+                writer.Key("c");
+                CommandCache::write_commands(writer, CommandCache::to_cached(s.result));
+                writer.EndObject();
+                semantic_cache_->append(s.embd_query.data(), sb.GetString(), runtime_.semantic_threshold);
+            }
+            //临时序列用完即清空,未decode的token(EOG或提前结束时的最后几个token)直接丢弃
+            s.stats.n_dropped = s.stats.early_stop ? (int) s.pending.size() : 0;
+            //剩余的token按n_batch分批decode之后才会采样到EOG,至少省去一次decode
+            s.stats.n_saved_decode = s.stats.early_stop ? std::max(1, ((int) s.pending.size() + n_batch_ - 1) / n_batch_) : 0;
+            s.pending.clear();
+            llama_memory_seq_rm(mem_, s.seq_id, -1, -1);
+        }
+        //问答通道的pending中保留最后采样的token(EOG),下一轮问答时与新的输入一起decode
+        s.n_fed = 0;
+        s.stats.t_done = GetCurrentUS();
+        trace_request(s);
+        record_latency(s);
+        if (s.cb.on_done) s.cb.on_done(s.stats);
+    }
+
+    static size_t lane(int sid, bool chat){ return (size_t) sid * kSeqPerSession + (chat ? 1 : 0); }
+
+    //llama_decode的计算过程中由ggml在各个节点之间调用,batch中有通道被请求取消时中断本次decode
+    static bool abort_callback(void *data){
+        const ControlEngine *self = (const ControlEngine *) data;
+        for (size_t i : self->batch_lanes_){
+            if (self->cancel_requested_[i].load(std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+
+    void apply_cancel_requests(){
+        for (size_t i = 0; i < sessions_.size(); i++){
+            if (cancel_requested_[i].exchange(false)) cancel(sessions_[i].id, sessions_[i].chat);
+        }
+    }
+
+    //撤销问答通道的当前轮:删除本轮写入的KV、消息和未送入的输入,保留上一轮留下的EOG,新的问题直接接在之前的历史之后.
+    //self-extend压缩过位置后轮的起点不再准确,只能从前缀重新开始
+    void rollback_turn(Session &s){
+        if (s.ga_i > 0 || s.chat_turns.empty()){
+            reset_history(s);
+            s.pending.clear();
+            return;
+        }
+        const ChatTurn turn = s.chat_turns.back();
+        const int k = turn.pos - (s.n_past - (int) s.n_fed); //本轮在pending中的起点
+        if (k >= (int) s.n_fed){
+            s.pending = std::vector<llama_token>(s.pending.begin() + s.n_fed, s.pending.begin() + k);
+        } else {
+            llama_memory_seq_rm(mem_, s.seq_id, turn.pos, -1);
+            s.n_kv -= s.n_past - turn.pos;
+            s.n_past = turn.pos;
+            s.pending.clear();
+        }
+        s.msgs.resize(turn.msg);
+        s.chat_turns.pop_back();
+    }
+
+    //问答通道的本轮因上下文已满无法继续:按出错结束,撤销本轮写入的KV和消息,之前的历史保留
+    void drop_turn(Session &s){
+        s.active = false;
+        rollback_turn(s);
+        s.n_fed = 0;
+        s.stats.error = true;
+        s.stats.t_done = GetCurrentUS();
+        resume(s, s.stats.t_done);
+        trace_request(s);
+        if (s.cb.on_done) s.cb.on_done(s.stats);
+    }
+
+    //问答通道恢复调度,累计本次暂停的时长
+    static void resume(Session &s, double now){
+        if (s.t_suspended == 0) return;
+        s.stats.suspended_us += now - s.t_suspended;
+        s.t_suspended = 0;
+    }
+
+    //整轮请求(提交到结束)画在通道自己的轨道上,多个通道交错执行时也不会与线程上的区间相互嵌套
+    static void trace_request(const Session &s){
+        Trace::record(s.chat ? "chat_request" : "control_request", s.stats.t_submit, s.stats.t_done - s.stats.t_submit,
+                      "n_prompt", s.stats.n_prompt, Trace::kSessionTrack + (int) (s.seq_id - kSeqWork));
+    }
+
+    //只统计正常完成的请求,每类保留最近kLatencyWindow轮
+    void record_latency(const Session &s){
+        if (s.stats.error || s.stats.cancelled) return;
+        ClassLatency &l = latency_[s.chat ? 1 : 0];
+        const double t_first = s.chat ? s.stats.t_first_token : s.stats.t_first_command;
+        auto push = [](std::vector<double> &v, double ms){
+            if (v.size() >= kLatencyWindow) v.erase(v.begin());
+            v.push_back(ms);
+        };
+        if (t_first > 0) push(l.first_ms, (t_first - s.stats.t_submit) / 1000);
+        push(l.total_ms, (s.stats.t_done - s.stats.t_submit) / 1000);
+        push(l.suspended_ms, s.stats.suspended_us / 1000);
+        if (s.stats.n_preempted > 0) l.n_preempted++;
+    }
+
+    common_params &params_;
+    llama_model *model_;
+    llama_context *ctx_;
+    llama_memory_t mem_;
+    const llama_vocab *vocab_;
+    ParamJson &param_json_;
+    const RuntimeConfig &runtime_;
+    ControlGrammar grammar_;
+    CommandCache command_cache_;
+    common_chat_templates_ptr chat_templates_;
+    uint64_t model_hash_ = 0; //prompt缓存文件头中的模型指纹
+    bool has_model_hash_ = false; //读取模型文件失败时没有指纹,不使用prompt缓存
+    llama_batch batch_;
+    int n_ctx_ = 0;
+    int n_ctx_seq_ = 0; //每个会话(两个通道合计)可用的KV单元数,不含共享的前缀
+    int n_batch_ = 0;
+    std::vector<Session> sessions_; //下标为 会话号*kSeqPerSession+(问答为1)
+    size_t next_ = 0; //轮转调度的起点
+    ClassLatency latency_[2]; //控制、问答
+    std::unique_ptr<std::atomic<bool>[]> cancel_requested_; //各通道的request_cancel(),下标与sessions_相同
+    std::vector<size_t> batch_lanes_; //正在decode的batch中的通道,供abort回调检查
+    OpProfiler *profiler_ = nullptr;
+    ThreadPools *pools_ = nullptr;
+
+    llama_model *embd_model_ = nullptr;
+    llama_context *embd_ctx_ = nullptr;
+    std::unique_ptr<SemanticCache> semantic_cache_;
+};
+
+#endif // CONTROL_ENGINE
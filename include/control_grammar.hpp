@@ -0,0 +1,192 @@
+#ifndef CONTROL_GRAMMAR
+#define CONTROL_GRAMMAR
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "param_json.hpp"
+
+//指令控制模式下模型输出的固定骨架,语法和后续的解析都以此为准,与微调数据(param.json中的示例)一样不带空格
+//[{"parameter":"<name>","value":<value>},{"parameter":"<name>","value":<value>}]
+static const char kCtrlListOpen[] = "[";
+static const char kCtrlObjOpen[] = "{\"parameter\":\"";
+static const char kCtrlValueSep[] = "\",\"value\":";
+static const char kCtrlObjClose[] = "}";
+static const char kCtrlObjSep[] = ",";
+static const char kCtrlListClose[] = "]";
+
+//根据param.json生成GBNF语法,只允许输出已知参数及其对应类型的值,或者拒绝语句
+class ControlGrammar{
+public:
+    std::string gbnf;
+    std::string refuse_str;
+    std::vector<std::pair<std::string, IAA_VALUE_TYPE_INTER>> params; //按名称排序,保证每次生成的语法一致
+    std::unordered_map<std::string, IAA_VALUE_TYPE_INTER> param_types;
+
+public:
+    explicit ControlGrammar(ParamJson &param_json){
+        refuse_str = param_json.refuse_str;
+        for (const auto &it : param_json.param_list){
+            params.push_back(std::make_pair(it.first, resolve_type(it.first, it.second, param_json.default_param)));
+        }
+        std::sort(params.begin(), params.end());
+        param_types.insert(params.begin(), params.end());
+        gbnf = build();
+    }
+
+    //param_list中的类型优先,无法识别时按default_value中的默认值推断
+    static IAA_VALUE_TYPE_INTER resolve_type(const std::string &name, const std::string &type,
+                                             std::unordered_map<std::string, std::shared_ptr<ParamValueBase>> &default_param){
+        if (type == "bool") return TYPE_BOOL;
+        if (type == "int") return TYPE_INT;
+        if (type == "float") return TYPE_FLOAT;
+        if (type == "string") return TYPE_STRING;
+        auto it = default_param.find(name);
+        if (it != default_param.end()){
+            if (it->second->type() == std::type_index(typeid(bool))) return TYPE_BOOL;
+            if (it->second->type() == std::type_index(typeid(float))) return TYPE_FLOAT;
+        }
+        return TYPE_STRING;
+    }
+
+    //GBNF的字符串字面量,需要转义引号、反斜杠和换行
+    static std::string literal(const std::string &s){
+        std::string out = "\"";
+        for (char c : s){
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            }
+            else if (c == '\n') out += "\\n";
+            else out += c;
+        }
+        out += "\"";
+        return out;
+    }
+
+    //jump-forward:根据已生成的内容,返回语法唯一允许的后续文本(固定骨架、参数名的唯一补全、bool值的剩余部分等),
+    //调用方可以将其一次性作为多token批次送入llama_decode,不存在唯一后续时返回空
+    std::string jump_forward(const std::string &out) const{
+        const std::string obj_open = kCtrlObjOpen;
+        const std::string value_sep = kCtrlValueSep;
+        const std::string next_obj = std::string(kCtrlObjClose) + kCtrlObjSep + kCtrlObjOpen;
+        //token可能只包含半个utf8字符,此时不做补全
+        if (out.empty() || utf8_valid_len(out) != out.size()) return "";
+        if (out[0] != kCtrlListOpen[0]){
+            return remainder(refuse_str, out);
+        }
+        size_t obj = out.rfind(obj_open);
+        if (obj == std::string::npos){
+            return remainder(obj_open, out.substr(1));
+        }
+        std::string rest = out.substr(obj + obj_open.size());
+        size_t quote = rest.find('"');
+        if (quote == std::string::npos){
+            return complete_name(rest);
+        }
+        std::string name = rest.substr(0, quote);
+        std::string tail = rest.substr(quote);
+        if (tail.size() < value_sep.size()){
+            return remainder(value_sep, tail);
+        }
+        auto it = param_types.find(name);
+        if (it == param_types.end()) return "";
+        std::string value = tail.substr(value_sep.size());
+        size_t value_len = 0;
+        switch (it->second){
+            case TYPE_BOOL:
+                if (value.empty()) return "";
+                for (const std::string lit : {"true", "false"}){
+                    if (value.size() < lit.size() && lit.compare(0, value.size(), value) == 0){
+                        return lit.substr(value.size()) + kCtrlObjClose;
+                    }
+                    if (value.compare(0, lit.size(), lit) == 0) value_len = lit.size();
+                }
+                break;
+            case TYPE_STRING:
+                if (value.empty()) return "\"";
+                value_len = value.find('"', 1);
+                if (value_len == std::string::npos) return "";
+                value_len += 1;
+                break;
+            default:
+                //数字的位数不确定,只能在模型输出"}"之后再继续补全
+                value_len = value.find_first_not_of("-0123456789.");
+                if (value_len == std::string::npos) return "";
+                break;
+        }
+        std::string after = value.substr(value_len);
+        if (after.empty()){
+            return it->second == TYPE_INT || it->second == TYPE_FLOAT ? "" : kCtrlObjClose;
+        }
+        //"}"之后可以是下一个对象或者"]"
+        if (after.size() == 1 || after[1] == kCtrlListClose[0]) return "";
+        return remainder(next_obj, after);
+    }
+
+private:
+    //full以prefix开头时返回剩余部分
+    static std::string remainder(const std::string &full, const std::string &prefix){
+        if (prefix.size() < full.size() && full.compare(0, prefix.size(), prefix) == 0){
+            return full.substr(prefix.size());
+        }
+        return "";
+    }
+
+    //返回s中完整utf8字符部分的长度
+    static size_t utf8_valid_len(const std::string &s){
+        size_t i = 0;
+        while (i < s.size()){
+            unsigned char c = s[i];
+            size_t n = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 1;
+            if (i + n > s.size()) break;
+            i += n;
+        }
+        return i;
+    }
+
+    //参数名的补全:所有候选参数名(含其后的分隔符)的最长公共前缀
+    std::string complete_name(const std::string &prefix) const{
+        const std::string value_sep = kCtrlValueSep;
+        auto first = std::lower_bound(params.begin(), params.end(), std::make_pair(prefix, TYPE_INT));
+        std::string common;
+        bool found = false;
+        for (auto it = first; it != params.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it){
+            std::string completion = it->first.substr(prefix.size()) + value_sep;
+            if (!found){
+                common = completion;
+                found = true;
+            }
+            else{
+                size_t n = 0;
+                while (n < common.size() && n < completion.size() && common[n] == completion[n]) n++;
+                common.resize(n);
+            }
+        }
+        common.resize(utf8_valid_len(common));
+        return common;
+    }
+
+    std::string build() const{
+        static const char *kTypeRules[] = { "int", "float", "bool", "string" }; //与IAA_VALUE_TYPE_INTER顺序一致
+        std::string g;
+        g += "root ::= cmd-list | refuse\n";
+        g += "refuse ::= " + literal(refuse_str) + "\n";
+        g += "cmd-list ::= " + literal(kCtrlListOpen) + " cmd ( " + literal(kCtrlObjSep) + " cmd )* " + literal(kCtrlListClose) + "\n";
+        g += "cmd ::= " + literal(kCtrlObjOpen) + " (";
+        for (size_t i = 0; i < params.size(); i++){
+            g += (i == 0 ? " " : " | ") + std::string("param-") + std::to_string(i);
+        }
+        g += " ) " + literal(kCtrlObjClose) + "\n";
+        for (size_t i = 0; i < params.size(); i++){
+            g += "param-" + std::to_string(i) + " ::= " + literal(params[i].first + kCtrlValueSep) + " " + kTypeRules[params[i].second] + "\n";
+        }
+        g += "bool ::= \"true\" | \"false\"\n";
+        g += "int ::= \"-\"? [0-9]{1,9}\n";
+        g += "float ::= \"-\"? [0-9]{1,9} (\".\" [0-9]{1,6})?\n";
+        g += "string ::= \"\\\"\" [^\"\\\\\\n]{0,64} \"\\\"\"\n";
+        return g;
+    }
+};
+
+#endif // CONTROL_GRAMMAR
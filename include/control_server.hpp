@@ -0,0 +1,368 @@
+#ifndef CONTROL_SERVER
+#define CONTROL_SERVER
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include "control_engine.hpp"
+
+//守护进程模式:通过Unix domain socket接收请求,以流的形式返回token、指令和统计信息.
+//每帧为4字节大端长度加JSON正文,请求:
+//  {"id": "1", "type": "infer", "mode": "control"|"chat", "text": "亮度调到50", "session": 0, "barge_in": true}
+//  {"id": "1", "type": "cancel"}
+//session可选,指定时固定使用该会话(问答模式的历史保存在会话中),不指定时使用该模式通道空闲的任意会话.
+//barge_in需与session一起使用,取消该会话同一模式排队中和进行中的请求(它们的done中cancelled为true),新请求立即开始.
+//同一会话的控制请求不需要等待问答结束,引擎会暂停问答的生成,done的timing中给出问答被暂停的时长.
+//响应的event依次为 token/command(零或多次) 和 done,请求有误时为error
+class ControlServer{
+public:
+    static const uint32_t kMaxFrame = 1 << 20;
+
+    ControlServer(ControlEngine &engine, const std::string &path) : engine_(engine), path_(path){
+        running_.resize(engine.n_sessions() * kSeqPerSession);
+    }
+
+    ~ControlServer(){
+        for (auto &c : clients_) close(c.first);
+        if (listen_fd_ >= 0){
+            close(listen_fd_);
+            unlink(path_.c_str());
+        }
+    }
+
+    bool start(){
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) return false;
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(addr.sun_path)) return false;
+        strcpy(addr.sun_path, path_.c_str());
+        unlink(path_.c_str());
+        if (bind(listen_fd_, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd_, 16) != 0){
+            LOG_ERR("%s: failed to listen on '%s': %s\n", __func__, path_.c_str(), strerror(errno));
+            return false;
+        }
+        fcntl(listen_fd_, F_SETFL, O_NONBLOCK);
+        LOG_INF("%s: listening on %s\n", __func__, path_.c_str());
+        return true;
+    }
+
+    //单线程事件循环:收发socket数据与engine.step()交替进行,引擎空闲时阻塞等待新的请求
+    void run(const volatile bool &stop){
+        while (!stop){
+            dispatch();
+            std::vector<struct pollfd> fds;
+            fds.push_back({listen_fd_, POLLIN, 0});
+            for (const auto &c : clients_) fds.push_back({c.first, POLLIN, 0});
+            if (poll(fds.data(), fds.size(), engine_.idle() ? 100 : 0) > 0){
+                if (fds[0].revents & POLLIN) accept_client();
+                for (size_t i = 1; i < fds.size(); i++){
+                    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) read_client(fds[i].fd);
+                }
+            }
+            //空闲时把缓存的修改写回文件
+            if (!engine_.step()) engine_.flush_caches();
+        }
+    }
+
+private:
+    struct Request{
+        std::string id;
+        int fd = -1;
+        std::string text;
+        bool chat = false;
+        int session = -1;
+        bool barge_in = false;
+        double t_recv = 0;
+        std::string partial; //token可能只包含半个utf8字符,凑齐后再发送
+    };
+
+    struct Client{
+        std::string inbuf;
+    };
+
+    void accept_client(){
+        int fd;
+        while ((fd = accept(listen_fd_, nullptr, nullptr)) >= 0){
+            clients_[fd] = Client();
+        }
+    }
+
+    void read_client(int fd){
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0){
+            drop_client(fd);
+            return;
+        }
+        std::string &in = clients_[fd].inbuf;
+        in.append(buf, n);
+        while (in.size() >= 4){
+            const uint32_t len = ((uint8_t) in[0] << 24) | ((uint8_t) in[1] << 16) | ((uint8_t) in[2] << 8) | (uint8_t) in[3];
+            if (len > kMaxFrame){
+                drop_client(fd);
+                return;
+            }
+            if (in.size() < 4 + (size_t) len) break;
+            const std::string body = in.substr(4, len);
+            in.erase(0, 4 + len);
+            handle(fd, body);
+        }
+    }
+
+    //客户端断开时取消它所有排队中和进行中的请求
+    void drop_client(int fd){
+        close(fd);
+        clients_.erase(fd);
+        for (auto it = queue_.begin(); it != queue_.end();){
+            if (it->fd == fd) it = queue_.erase(it);
+            else ++it;
+        }
+        for (size_t slot = 0; slot < running_.size(); slot++){
+            if (running_[slot].fd == fd){
+                running_[slot].fd = -1;
+                cancel_slot(slot);
+            }
+        }
+    }
+
+    void handle(int fd, const std::string &body){
+        rapidjson::Document doc;
+        if (doc.Parse(body.c_str()).HasParseError() || !doc.IsObject()){
+            send_error(fd, "", "invalid json");
+            return;
+        }
+        Request req;
+        req.fd = fd;
+        req.t_recv = GetCurrentUS();
+        if (doc.HasMember("id") && doc["id"].IsString()) req.id = doc["id"].GetString();
+        else if (doc.HasMember("id") && doc["id"].IsInt64()) req.id = std::to_string(doc["id"].GetInt64());
+        const std::string type = doc.HasMember("type") && doc["type"].IsString() ? doc["type"].GetString() : "infer";
+        if (type == "cancel"){
+            cancel(fd, req.id);
+            return;
+        }
+        if (type != "infer" || !doc.HasMember("text") || !doc["text"].IsString()){
+            send_error(fd, req.id, "expected type infer with a text field");
+            return;
+        }
+        req.text = doc["text"].GetString();
+        req.chat = doc.HasMember("mode") && doc["mode"].IsString() && strcmp(doc["mode"].GetString(), "chat") == 0;
+        if (doc.HasMember("session") && doc["session"].IsInt()){
+            req.session = doc["session"].GetInt();
+            if (req.session < 0 || req.session >= engine_.n_sessions()){
+                send_error(fd, req.id, "session out of range");
+                return;
+            }
+        }
+        req.barge_in = req.session >= 0 && doc.HasMember("barge_in") && doc["barge_in"].IsBool() && doc["barge_in"].GetBool();
+        if (req.barge_in){
+            for (auto it = queue_.begin(); it != queue_.end();){
+                if (it->session == req.session && it->chat == req.chat){
+                    send_cancelled(*it);
+                    it = queue_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        queue_.push_back(req);
+    }
+
+    void cancel(int fd, const std::string &id){
+        for (auto it = queue_.begin(); it != queue_.end(); ++it){
+            if (it->fd == fd && it->id == id){
+                send_cancelled(*it);
+                queue_.erase(it);
+                return;
+            }
+        }
+        for (size_t slot = 0; slot < running_.size(); slot++){
+            if (running_[slot].fd == fd && running_[slot].id == id) cancel_slot(slot);
+        }
+    }
+
+    void cancel_slot(size_t slot){
+        engine_.cancel((int) (slot / kSeqPerSession), slot % kSeqPerSession == 1);
+    }
+
+    //还没有开始的请求被取消
+    void send_cancelled(const Request &req){
+        EngineStats stats;
+        stats.cancelled = true;
+        stats.t_submit = stats.t_done = GetCurrentUS();
+        send_done(req, stats);
+    }
+
+    //按先来先服务把排队的请求分配给对应模式的空闲通道
+    void dispatch(){
+        for (auto it = queue_.begin(); it != queue_.end();){
+            const bool chat = it->chat;
+            int sid = it->session;
+            //barge-in时取消同一通道上过时的请求,问答历史和前缀的KV保留给新的请求
+            if (it->barge_in) engine_.cancel(sid, chat);
+            if (sid < 0){
+                for (int i = 0; i < engine_.n_sessions() && sid < 0; i++){
+                    if (!engine_.busy(i, chat)) sid = i;
+                }
+            }
+            if (sid < 0 || engine_.busy(sid, chat)){
+                ++it;
+                continue;
+            }
+            const size_t slot = (size_t) sid * kSeqPerSession + (chat ? 1 : 0);
+            running_[slot] = *it;
+            it = queue_.erase(it);
+            EngineCallbacks cb;
+            cb.on_token = [this, slot](const std::string &piece){
+                std::string &text = running_[slot].partial;
+                text += piece;
+                const size_t n = complete_utf8(text);
+                if (n == 0) return;
+                rapidjson::StringBuffer sb;
+                rapidjson::Writer<rapidjson::StringBuffer> w(sb);
+                begin_event(w, running_[slot].id, "token");
+                w.Key("text");
+                w.String(text.c_str(), n);
+                text.erase(0, n);
+                w.EndObject();
+                send_frame(running_[slot].fd, sb);
+            };
+            cb.on_command = [this, slot](const Iaa_Param_Inter &p){
+                rapidjson::StringBuffer sb;
+                rapidjson::Writer<rapidjson::StringBuffer> w(sb);
+                begin_event(w, running_[slot].id, "command");
+                w.Key("parameter");
+                w.String(p.name);
+                w.Key("value");
+                switch (p.value_type){
+                    case TYPE_BOOL: w.Bool(p.value.b); break;
+                    case TYPE_INT: w.Int(p.value.i); break;
+                    case TYPE_FLOAT: w.Double(p.value.f); break;
+                    case TYPE_STRING: w.String(p.value.s); break;
+                }
+                w.EndObject();
+                send_frame(running_[slot].fd, sb);
+            };
+            cb.on_done = [this, slot](const EngineStats &stats){
+                send_done(running_[slot], stats);
+                running_[slot] = Request();
+            };
+            engine_.submit(sid, running_[slot].text, chat, cb);
+        }
+    }
+
+    //去掉末尾不完整的utf8字符后的长度
+    static size_t complete_utf8(const std::string &s){
+        size_t i = s.size();
+        for (size_t k = 1; k <= 3 && k <= s.size(); k++){
+            const unsigned char c = s[s.size() - k];
+            if ((c & 0xc0) == 0x80) continue;
+            const size_t need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+            if (need > k) i = s.size() - k;
+            break;
+        }
+        return i;
+    }
+
+    static void begin_event(rapidjson::Writer<rapidjson::StringBuffer> &w, const std::string &id, const char *event){
+        w.StartObject();
+        w.Key("id");
+        w.String(id.c_str());
+        w.Key("event");
+        w.String(event);
+    }
+
+    //时间均为相对于收到请求时刻的毫秒数
+    void send_done(const Request &req, const EngineStats &stats){
+        auto ms = [&req](double t){ return t > 0 ? (t - req.t_recv) / 1000 : -1.0; };
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> w(sb);
+        begin_event(w, req.id, "done");
+        w.Key("source");
+        w.String(stats.source);
+        w.Key("cancelled");
+        w.Bool(stats.cancelled);
+        w.Key("error");
+        w.Bool(stats.error);
+        w.Key("n_prompt");
+        w.Int(stats.n_prompt);
+        w.Key("n_sampled");
+        w.Int(stats.n_sampled);
+        w.Key("n_forced");
+        w.Int(stats.n_forced);
+        w.Key("early_stop");
+        w.Bool(stats.early_stop);
+        w.Key("n_saved_decode");
+        w.Int(stats.n_saved_decode);
+        w.Key("timing");
+        w.StartObject();
+        w.Key("queue_ms");
+        w.Double(ms(stats.t_submit));
+        w.Key("first_token_ms");
+        w.Double(ms(stats.t_first_token));
+        w.Key("first_command_ms");
+        w.Double(ms(stats.t_first_command));
+        w.Key("total_ms");
+        w.Double(ms(stats.t_done));
+        w.Key("suspended_ms");
+        w.Double(stats.suspended_us / 1000);
+        w.Key("n_preempted");
+        w.Int(stats.n_preempted);
+        w.EndObject();
+        w.EndObject();
+        send_frame(req.fd, sb);
+    }
+
+    void send_error(int fd, const std::string &id, const char *message){
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> w(sb);
+        begin_event(w, id, "error");
+        w.Key("message");
+        w.String(message);
+        w.EndObject();
+        send_frame(fd, sb);
+    }
+
+    //本地socket直接阻塞发送,客户端已断开时丢弃
+    void send_frame(int fd, const rapidjson::StringBuffer &sb){
+        if (fd < 0) return;
+        const uint32_t len = sb.GetSize();
+        std::string frame(4, '\0');
+        frame[0] = (char) (len >> 24);
+        frame[1] = (char) (len >> 16);
+        frame[2] = (char) (len >> 8);
+        frame[3] = (char) len;
+        frame.append(sb.GetString(), len);
+        size_t off = 0;
+        while (off < frame.size()){
+            ssize_t n = send(fd, frame.data() + off, frame.size() - off, MSG_NOSIGNAL);
+            if (n <= 0){
+                if (n < 0 && errno == EINTR) continue;
+                return;
+            }
+            off += n;
+        }
+    }
+
+    ControlEngine &engine_;
+    std::string path_;
+    int listen_fd_ = -1;
+    std::map<int, Client> clients_;
+    std::deque<Request> queue_;
+    std::vector<Request> running_; //每个通道当前处理的请求,下标与引擎的通道相同
+};
+
+#endif // CONTROL_SERVER
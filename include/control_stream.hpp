@@ -0,0 +1,164 @@
+#ifndef CONTROL_STREAM
+#define CONTROL_STREAM
+#include <functional>
+#include <string>
+#include <vector>
+#include "rapidjson/reader.h"
+#include "param_json.hpp"
+
+//单个{"parameter": ..., "value": ...}对象的SAX处理器,只记录第一层的parameter和value
+struct ControlObjectHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, ControlObjectHandler> {
+    int depth = 0;
+    std::string key;
+    std::string name;
+    bool has_name = false;
+    bool has_value = false;
+    rapidjson::Document value;
+
+    bool is_value() const { return depth == 1 && key == "value"; }
+    bool Default() { return true; }
+    bool Null() { if (is_value()) { value.SetNull(); has_value = true; } return true; }
+    bool Bool(bool b) { if (is_value()) { value.SetBool(b); has_value = true; } return true; }
+    bool Int(int i) { if (is_value()) { value.SetInt(i); has_value = true; } return true; }
+    bool Uint(unsigned u) { if (is_value()) { value.SetUint(u); has_value = true; } return true; }
+    bool Int64(int64_t i) { if (is_value()) { value.SetInt64(i); has_value = true; } return true; }
+    bool Uint64(uint64_t u) { if (is_value()) { value.SetUint64(u); has_value = true; } return true; }
+    bool Double(double d) { if (is_value()) { value.SetDouble(d); has_value = true; } return true; }
+    bool String(const char* str, rapidjson::SizeType length, bool) {
+        if (depth == 1 && key == "parameter") {
+            name.assign(str, length);
+            has_name = true;
+        }
+        else if (is_value()) {
+            value.SetString(str, length, value.GetAllocator());
+            has_value = true;
+        }
+        return true;
+    }
+    bool Key(const char* str, rapidjson::SizeType length, bool) {
+        if (depth == 1) key.assign(str, length);
+        return true;
+    }
+    bool StartObject() { depth++; return true; }
+    bool EndObject(rapidjson::SizeType) { depth--; return true; }
+    bool StartArray() { depth++; return true; }
+    bool EndArray(rapidjson::SizeType) { depth--; return true; }
+};
+
+//生成过程中逐个token喂入模型输出,每当一个{parameter, value}对象闭合时立刻解析并通过回调输出,
+//不需要等到EOG之后再对整段输出调用pars_control。
+//rapidjson的迭代解析(IterativeParseNext)从输入流中拉取字符,读到未生成完的结尾时只能报错,
+//Reader也不能复制保存状态,无法在下一个token到来后继续;因此由scan()只跟踪括号和字符串,
+//对象闭合后再用SAX解析这一小段,每个字符只被扫描一次,对象只解析一次
+class ControlStreamParser{
+public:
+    typedef std::function<void(const Iaa_Param_Inter &)> Callback;
+
+    ControlStreamParser(ParamJson &param_json, Callback callback) : param_json_(param_json), callback_(callback){
+    }
+
+    //每轮开始前调用,user_str用于command_clean
+    void reset(const std::string &user_str){
+        user_str_ = user_str;
+        buffer_.clear();
+        depth_ = 0;
+        obj_depth_ = -1;
+        obj_start_ = std::string::npos;
+        in_string_ = false;
+        escape_ = false;
+        emitted_ = 0;
+        invalid_ = false;
+        refused_ = false;
+    }
+
+    void feed(const std::string &piece){
+        for (char c : piece){
+            buffer_ += c;
+            scan(c);
+        }
+        //模型拒绝执行
+        if (emitted_ == 0 && !invalid_ && buffer_ == param_json_.refuse_str){
+            refused_ = true;
+            emit_invalid();
+        }
+    }
+
+    int emitted() const { return emitted_; }
+    //顶层的数组/对象已经闭合,或者已经输出了完整的拒绝语句,之后的输出(空白、EOG)都没有意义
+    bool complete() const { return (obj_depth_ >= 0 && depth_ == 0 && !in_string_) || refused_; }
+    const std::string &text() const { return buffer_; }
+
+private:
+    void scan(char c){
+        if (in_string_){
+            if (escape_) escape_ = false;
+            else if (c == '\\') escape_ = true;
+            else if (c == '"') in_string_ = false;
+            return;
+        }
+        switch (c){
+            case '"':
+                in_string_ = true;
+                break;
+            case '[':
+            case '{':
+                //顶层是数组时指令对象位于第1层,顶层直接是对象时位于第0层
+                if (obj_depth_ < 0) obj_depth_ = c == '[' ? 1 : 0;
+                if (c == '{' && depth_ == obj_depth_) obj_start_ = buffer_.size() - 1;
+                depth_++;
+                break;
+            case ']':
+            case '}':
+                depth_--;
+                if (c == '}' && depth_ == obj_depth_ && obj_start_ != std::string::npos){
+                    emit_object(buffer_.substr(obj_start_));
+                    obj_start_ = std::string::npos;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void emit_object(const std::string &obj){
+        ControlObjectHandler handler;
+        rapidjson::Reader reader;
+        rapidjson::StringStream ss(obj.c_str());
+        if (reader.Parse(ss, handler).IsError() || !handler.has_name || !handler.has_value){
+            return;
+        }
+        std::vector<Iaa_Param_Inter> one(1);
+        if (!param_json_.make_param(handler.name, handler.value, one[0])){
+            emit_invalid();
+            return;
+        }
+        param_json_.command_clean(one, user_str_);
+        emitted_++;
+        callback_(one[0]);
+    }
+
+    //一轮中只输出一次无效指令,与pars_control保持一致
+    void emit_invalid(){
+        if (invalid_) return;
+        invalid_ = true;
+        std::vector<Iaa_Param_Inter> one;
+        param_json_.push_invalid(one);
+        emitted_++;
+        callback_(one[0]);
+    }
+
+    ParamJson &param_json_;
+    Callback callback_;
+    std::string user_str_;
+    std::string buffer_;
+    int depth_ = 0;
+    int obj_depth_ = -1;
+    size_t obj_start_ = std::string::npos;
+    bool in_string_ = false;
+    bool escape_ = false;
+    int emitted_ = 0;
+    bool invalid_ = false;
+    bool refused_ = false;
+};
+
+#endif // CONTROL_STREAM
@@ -0,0 +1,62 @@
+#ifndef FILE_HASH
+#define FILE_HASH
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//FNV-1a,与ParamJson::json_hash相同的算法,seed用于把多段数据串起来计算
+static inline uint64_t fnv1a(const void *data, size_t size, uint64_t seed = 14695981039346656037ULL){
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++){
+        seed = (seed ^ p[i]) * 1099511628211ULL;
+    }
+    return seed;
+}
+
+//模型文件的指纹:文件大小加上头部和尾部各kSample字节的hash.
+//gguf的头部包含全部元数据和张量信息,尾部为最后的权重,量化方式或权重有变化时都会改变;
+//完整读取几GB的模型计算hash会明显拖慢启动.读取失败时返回false,调用者应当把缓存视为不匹配
+static inline bool model_fingerprint(const std::string &path, uint64_t &fingerprint){
+    const size_t kSample = 4 << 20;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        close(fd);
+        return false;
+    }
+    const uint64_t size = (uint64_t) st.st_size;
+    uint64_t hash = fnv1a(&size, sizeof(size));
+    std::vector<char> buf(kSample);
+    const off_t offsets[2] = {0, st.st_size > (off_t) kSample ? st.st_size - (off_t) kSample : 0};
+    for (off_t off : offsets){
+        const ssize_t n = pread(fd, buf.data(), buf.size(), off);
+        if (n < 0){
+            close(fd);
+            return false;
+        }
+        hash = fnv1a(buf.data(), (size_t) n, hash);
+    }
+    close(fd);
+    fingerprint = hash;
+    return true;
+}
+
+//先写临时文件再rename替换时的临时文件名:同一路径可能被多个进程或handle同时写入,按进程号和写入者的地址区分
+static inline std::string temp_path(const std::string &path, const void *owner){
+    char buf[64];
+    snprintf(buf, sizeof(buf), ".tmp.%d.%p", (int) getpid(), owner);
+    return path + buf;
+}
+
+static inline std::string hash_hex(uint64_t hash){
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) hash);
+    return buf;
+}
+
+#endif // FILE_HASH
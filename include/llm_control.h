@@ -0,0 +1,72 @@
+#ifndef LLM_CONTROL_H
+#define LLM_CONTROL_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//指令的值类型和结构,与设备固件之间的C接口
+typedef enum IAA_VALUE_TYPE_INTER { TYPE_INT, TYPE_FLOAT, TYPE_BOOL, TYPE_STRING } IAA_VALUE_TYPE_INTER;
+typedef struct _Iaa_Param_Inter
+{
+    const char* name;
+    IAA_VALUE_TYPE_INTER value_type;
+    union {
+        int i;
+        float f;
+        bool b;
+        const char* s;
+    } value;
+}Iaa_Param_Inter;
+
+//多个llm_handle可以共享同一个llm_model,每个handle有自己的上下文、param.json和prompt缓存,
+//不同handle可以在不同线程中同时调用llm_infer,同一个handle不能并发调用
+typedef struct llm_model llm_model;
+typedef struct llm_handle llm_handle;
+
+typedef enum { LLM_MODE_CONTROL = 0, LLM_MODE_CHAT = 1 } llm_mode;
+
+//一轮请求的统计,时间单位为毫秒,从llm_infer被调用时开始计算,没有发生时为-1
+typedef struct {
+    const char *source;       //model/rules/cache/semantic
+    double first_token_ms;
+    double first_command_ms;
+    double total_ms;
+    int n_prompt;
+    int n_sampled;
+    int n_forced;
+    bool early_stop;
+    int n_saved_decode;       //提前结束省去的decode次数
+    bool cancelled;
+    bool error;
+} llm_stats;
+
+//回调均在调用llm_infer的线程中执行,piece和指令中的字符串只在回调期间有效
+typedef struct {
+    void (*on_token)(const char *piece, void *user_data);
+    void (*on_command)(const Iaa_Param_Inter *command, void *user_data);
+    void (*on_done)(const llm_stats *stats, void *user_data);
+    void *user_data;
+} llm_callbacks;
+
+//加载模型,n_threads<=0时使用默认线程数,失败返回NULL
+llm_model *llm_model_load(const char *model_path, int n_threads);
+//所有使用该模型的handle都释放之后才能释放模型
+void llm_model_free(llm_model *model);
+
+//在已加载的模型上创建handle,param_json_path为指令定义,prompt_cache_path为system prompt缓存文件
+//(不存在或与模型、prompt不匹配时自动重建;param.json不同的handle应使用不同的文件),失败返回NULL
+llm_handle *llm_init(llm_model *model, const char *param_json_path, const char *prompt_cache_path);
+//执行一轮推理直到结束或被取消,token和指令通过回调流式输出,成功返回0
+int llm_infer(llm_handle *handle, const char *utterance, llm_mode mode, const llm_callbacks *callbacks);
+//取消handle上正在进行的llm_infer,可以在其它线程或回调中调用
+void llm_cancel(llm_handle *handle);
+void llm_free(llm_handle *handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LLM_CONTROL_H
@@ -0,0 +1,125 @@
+#ifndef OP_PROFILER
+#define OP_PROFILER
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "common.h"
+#include "ggml.h"
+#include "trace.hpp"
+
+//按ggml算子统计耗时和计算量:通过cb_eval回调观察图中的每个节点,调度器会在询问(ask=true)之后立即计算该节点,
+//计算完成后再次回调(ask=false),两次回调的间隔即该节点的耗时.
+//每个节点都会单独提交和同步,开启后整体会变慢,只用于比较各算子/各层的相对占比
+class OpProfiler{
+public:
+    struct OpStats{
+        double us = 0;
+        double flops = 0;
+        int64_t count = 0;
+    };
+
+    //在创建上下文之前调用,回调在调用llama_decode的线程中执行
+    void install(common_params &params){
+        params.cb_eval = eval_callback;
+        params.cb_eval_user_data = this;
+    }
+
+    //之后的llama_decode属于prefill还是decode,一个batch中只要有会话在prefill就算作prefill
+    void set_phase(bool prefill){ prefill_ = prefill; }
+
+    //清空本轮的统计,累计的统计保留到退出
+    void reset_request(){
+        request_ops_.clear();
+        request_layers_.clear();
+    }
+
+    //按耗时排序的算子表和每层的耗时,top<=0时输出全部算子
+    std::string report(bool request, int top) const{
+        const auto &ops = request ? request_ops_ : total_ops_;
+        const auto &layers = request ? request_layers_ : total_layers_;
+        std::vector<std::pair<std::pair<std::string, int>, OpStats>> rows(ops.begin(), ops.end());
+        std::sort(rows.begin(), rows.end(), [](const std::pair<std::pair<std::string, int>, OpStats> &a,
+                                               const std::pair<std::pair<std::string, int>, OpStats> &b){
+            return a.second.us > b.second.us;
+        });
+        double total_us = 0;
+        for (const auto &r : rows) total_us += r.second.us;
+
+        std::string out;
+        char line[256];
+        snprintf(line, sizeof(line), "%-16s %-8s %10s %10s %7s %10s %9s\n", "op", "phase", "count", "total_ms", "share", "avg_us", "GFLOPS");
+        out += line;
+        for (size_t i = 0; i < rows.size() && (top <= 0 || (int) i < top); i++){
+            const OpStats &s = rows[i].second;
+            snprintf(line, sizeof(line), "%-16s %-8s %10lld %10.3f %6.1f%% %10.2f %9.2f\n", rows[i].first.first.c_str(),
+                     rows[i].first.second ? "prefill" : "decode", (long long) s.count, s.us / 1000,
+                     total_us > 0 ? 100 * s.us / total_us : 0, s.count ? s.us / s.count : 0, s.us > 0 ? s.flops / s.us / 1000 : 0);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "%-8s %12s %12s\n", "layer", "prefill_ms", "decode_ms");
+        out += line;
+        for (const auto &l : layers){
+            snprintf(line, sizeof(line), "%-8s %12.3f %12.3f\n", l.first < 0 ? "-" : std::to_string(l.first).c_str(),
+                     l.second.first / 1000, l.second.second / 1000);
+            out += line;
+        }
+        return out;
+    }
+
+private:
+    static bool eval_callback(struct ggml_tensor *t, bool ask, void *user_data){
+        return ((OpProfiler *) user_data)->on_eval(t, ask);
+    }
+
+    //矩阵乘按2*K*输出元素数计算,其它算子按每个输出元素一次运算粗略估计
+    static double estimate_flops(const struct ggml_tensor *t){
+        const double n = (double) ggml_nelements(t);
+        if ((t->op == GGML_OP_MUL_MAT || t->op == GGML_OP_MUL_MAT_ID) && t->src[0]){
+            return 2.0 * t->src[0]->ne[0] * n;
+        }
+        return n;
+    }
+
+    //llama.cpp中每层的张量名为"名称-层号",没有层号的(输入、输出)记为-1
+    static int layer_of(const struct ggml_tensor *t){
+        const char *dash = strrchr(t->name, '-');
+        if (!dash || dash[1] < '0' || dash[1] > '9') return -1;
+        return atoi(dash + 1);
+    }
+
+    bool on_eval(struct ggml_tensor *t, bool ask){
+        if (ask){
+            t_ask_ = Trace::now_us();
+            return true;
+        }
+        const double us = Trace::now_us() - t_ask_;
+        const double flops = estimate_flops(t);
+        const std::pair<std::string, int> key(ggml_op_desc(t), prefill_ ? 1 : 0);
+        for (auto *ops : {&request_ops_, &total_ops_}){
+            OpStats &s = (*ops)[key];
+            s.us += us;
+            s.flops += flops;
+            s.count++;
+        }
+        const int layer = layer_of(t);
+        for (auto *layers : {&request_layers_, &total_layers_}){
+            auto &l = (*layers)[layer];
+            (prefill_ ? l.first : l.second) += us;
+        }
+        return true;
+    }
+
+    bool prefill_ = true;
+    double t_ask_ = 0;
+    std::map<std::pair<std::string, int>, OpStats> request_ops_; //(算子, 是否prefill) -> 统计
+    std::map<std::pair<std::string, int>, OpStats> total_ops_;
+    std::map<int, std::pair<double, double>> request_layers_;    //层号 -> (prefill耗时, decode耗时)
+    std::map<int, std::pair<double, double>> total_layers_;
+};
+
+#endif // OP_PROFILER
@@ -6,22 +6,51 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <memory>
 #include <typeindex>
-#include <regex>
 #include "rapidjson/document.h"
+#include "rule_matcher.hpp"
+#include "llm_control.h"
 
-enum IAA_VALUE_TYPE_INTER { TYPE_INT, TYPE_FLOAT, TYPE_BOOL, TYPE_STRING };
-typedef struct _Iaa_Param_Inter
-{
-    const char* name;
-    IAA_VALUE_TYPE_INTER value_type;
-    union {
-        int i;
-        float f;
-        bool b;
-        const char* s;
-    } value;
-}Iaa_Param_Inter;
+//ggml线程池的配置,未设置的字段沿用命令行的线程数和llama.cpp的默认值
+struct ThreadPoolConfig{
+    int n_threads = 0;     //0表示使用命令行的thread参数
+    std::string cpumask;   //十六进制CPU掩码,如"0xF0"
+    std::string cpu_range; //CPU范围,如"4-7"
+    int poll = -1;         //空闲时忙等的程度0-100
+    int priority = -1;     //0 normal,1 medium,2 high,3 realtime
+    int strict_cpu = -1;   //1时每个线程固定到掩码中的一个CPU
+};
+
+//self-extend分组注意力:超出窗口w的历史按n个位置合并为一个位置,n为1时不启用
+struct GroupAttnConfig{
+    int n = 1;
+    int w = 512; //需为n的整数倍
+};
+
+//param.json中可选的"runtime"对象,控制推理流程的各项开关,未配置时使用这里的默认值
+struct RuntimeConfig{
+    bool jump_forward = true; //控制模式下直接补全语法唯一确定的token,减少单token的decode次数
+    bool rules = true;        //控制模式的规则快速通道,简单语句不经过模型直接得到指令
+    int sessions = 1;         //同时服务的会话数,每个会话占用两个KV序列(控制和问答),共享同一个上下文
+    bool cache = true;        //控制模式的指令缓存,相同(归一化后)语句直接返回缓存的指令
+    int cache_capacity = 256;
+    std::string cache_path;   //指令缓存的持久化文件,为空时不保存
+    std::string semantic_cache_path; //语义指令缓存的索引文件,为空时不启用语义缓存
+    float semantic_threshold = 0.95f; //余弦相似度不低于该值时直接使用缓存的指令
+    int semantic_capacity = 4096;     //语义缓存的记录数上限,超出后覆盖最旧的记录
+    std::string semantic_model;      //单独的embedding模型,为空时使用当前加载的模型
+    std::string trace_path;   //不为空时记录每轮请求的时间线,导出为Chrome trace JSON
+    bool profile_ops = false; //通过cb_eval按算子和层统计耗时,每轮和退出时输出排名表,开启后推理会变慢
+    ThreadPoolConfig prefill_pool; //"threadpool": {"prefill": {...}, "decode": {...}}
+    ThreadPoolConfig decode_pool;
+    std::string autotune = "off"; //off/auto(使用缓存的调优结果,没有时先调优)/force(重新调优),配置了cpumask或cpu_range时不调优
+    std::string autotune_path;    //调优结果的缓存文件,为空时为prompt缓存路径加".threads.json"
+    int n_ctx = 0;                //上下文的KV单元数,0时使用默认值;开启self-extend时可以超过模型训练的上下文长度
+    GroupAttnConfig chat_group_attn;    //"group_attn": {"chat": {"n": 4, "w": 1024}, "control": {...}}
+    GroupAttnConfig control_group_attn;
+};
 
 template<typename T>
 class ParamValueSub;
@@ -57,11 +86,18 @@ private:
 class ParamJson{
 public:
     //static const char* kTypeNames[7];
-    const char *ai_prompt;
+    const char *ai_control = ""; //指令控制模式的system prompt
+    const char *ai_chat = "";    //知识问答模式的system prompt,为空时与指令控制模式共用
     const char* json_path;
+    std::string refuse_str = "暂不支持该操作"; //模型拒绝执行时的固定回复
     bool invalid_command = false;
     std::unordered_map<std::string, std::string> param_list;
     std::unordered_map<std::string, std::shared_ptr<ParamValueBase>> default_param;
+    RuntimeConfig runtime;
+    uint64_t json_hash = 0; //param.json内容的hash,用于判断各种缓存是否对应当前的配置
+    static const size_t kMaxInterned = 1024; //字符串池的上限,模型输出的任意字符串不能让它无限增长
+    std::unordered_set<std::string> str_pool;
+    RuleMatcher rules; //由param_list和控制模式prompt编译的规则匹配器
     rapidjson::Document doc;
     rapidjson::Document result_doc;
 
@@ -79,6 +115,10 @@ public:
         }
         buffer << file.rdbuf();
         std::string jsonStr = buffer.str();
+        json_hash = 14695981039346656037ULL; //FNV-1a
+        for (unsigned char c : jsonStr) {
+            json_hash = (json_hash ^ c) * 1099511628211ULL;
+        }
         if (doc.Parse(jsonStr.c_str()).HasParseError()) {
             std::cerr << "param.json 解析失败！" << std::endl;
             return -1;
@@ -94,11 +134,23 @@ public:
                         //printf("key is %s, value type is %s\n", itr->name.GetString(), kTypeNames[itr->value.GetType()]);
                     }
                 }
+                //加载推理流程的配置
+                else if (obj.HasMember("runtime") && obj["runtime"].IsObject()){
+                    GetRuntime(obj["runtime"]);
+                }
                 //确认有那些被控参数,并读取prompt
                 else{
-                    for (rapidjson::Value::ConstMemberIterator itr = obj.MemberBegin(); itr != doc[0].MemberEnd(); ++itr){
+                    for (rapidjson::Value::ConstMemberIterator itr = obj.MemberBegin(); itr != obj.MemberEnd(); ++itr){
+                        //AI_PROMPT为两种模式共用的prompt,AI_CONTROL/AI_CHAT分别对应两种模式
                         if(strcmp(itr->name.GetString(), "AI_PROMPT") == 0){
-                            ai_prompt=itr->value.GetString();
+                            ai_control=itr->value.GetString();
+                            ai_chat=itr->value.GetString();
+                        }
+                        else if(strcmp(itr->name.GetString(), "AI_CONTROL") == 0){
+                            ai_control=itr->value.GetString();
+                        }
+                        else if(strcmp(itr->name.GetString(), "AI_CHAT") == 0){
+                            ai_chat=itr->value.GetString();
                         }
                         else{
                             param_list.insert(std::pair<std::string, std::string>(itr->name.GetString(), itr->value.GetString()));
@@ -111,9 +163,64 @@ public:
         else{
             std::cerr << "param.json顶层不是Array,请重新编辑正确的param.json" << std::endl;
         }
+        if (strlen(ai_chat) == 0) ai_chat = ai_control;
+        //部分param.json用parse_fail作为无效指令的回复
+        if (default_param.find("无效指令") == default_param.end()){
+            auto it = default_param.find("parse_fail");
+            default_param["无效指令"] = it != default_param.end() ? it->second : std::make_shared<ParamValueSub<const char *>>(refuse_str.c_str());
+        }
+        //语义缓存也用规则匹配器核对数字和枚举值
+        if (runtime.rules || !runtime.semantic_cache_path.empty()) rules.compile(param_list, ai_control);
         return 0;
     }
 
+    void GetRuntime(const rapidjson::Value &obj){
+        if (obj.HasMember("jump_forward") && obj["jump_forward"].IsBool()) runtime.jump_forward = obj["jump_forward"].GetBool();
+        if (obj.HasMember("rules") && obj["rules"].IsBool()) runtime.rules = obj["rules"].GetBool();
+        if (obj.HasMember("sessions") && obj["sessions"].IsInt() && obj["sessions"].GetInt() > 0) runtime.sessions = obj["sessions"].GetInt();
+        if (obj.HasMember("cache") && obj["cache"].IsBool()) runtime.cache = obj["cache"].GetBool();
+        if (obj.HasMember("cache_capacity") && obj["cache_capacity"].IsInt()) runtime.cache_capacity = obj["cache_capacity"].GetInt();
+        if (obj.HasMember("cache_path") && obj["cache_path"].IsString()) runtime.cache_path = obj["cache_path"].GetString();
+        if (obj.HasMember("semantic_cache_path") && obj["semantic_cache_path"].IsString()) runtime.semantic_cache_path = obj["semantic_cache_path"].GetString();
+        if (obj.HasMember("semantic_threshold") && obj["semantic_threshold"].IsNumber()) runtime.semantic_threshold = obj["semantic_threshold"].GetFloat();
+        if (obj.HasMember("semantic_capacity") && obj["semantic_capacity"].IsInt()) runtime.semantic_capacity = obj["semantic_capacity"].GetInt();
+        if (obj.HasMember("semantic_model") && obj["semantic_model"].IsString()) runtime.semantic_model = obj["semantic_model"].GetString();
+        if (obj.HasMember("trace_path") && obj["trace_path"].IsString()) runtime.trace_path = obj["trace_path"].GetString();
+        if (obj.HasMember("profile_ops") && obj["profile_ops"].IsBool()) runtime.profile_ops = obj["profile_ops"].GetBool();
+        if (obj.HasMember("autotune") && obj["autotune"].IsString()) runtime.autotune = obj["autotune"].GetString();
+        if (obj.HasMember("autotune_path") && obj["autotune_path"].IsString()) runtime.autotune_path = obj["autotune_path"].GetString();
+        if (obj.HasMember("n_ctx") && obj["n_ctx"].IsInt() && obj["n_ctx"].GetInt() >= 0) runtime.n_ctx = obj["n_ctx"].GetInt();
+        if (obj.HasMember("group_attn") && obj["group_attn"].IsObject()){
+            const rapidjson::Value &ga = obj["group_attn"];
+            if (ga.HasMember("chat") && ga["chat"].IsObject()) GetGroupAttn(ga["chat"], runtime.chat_group_attn);
+            if (ga.HasMember("control") && ga["control"].IsObject()) GetGroupAttn(ga["control"], runtime.control_group_attn);
+        }
+        if (obj.HasMember("threadpool") && obj["threadpool"].IsObject()){
+            const rapidjson::Value &pools = obj["threadpool"];
+            if (pools.HasMember("prefill") && pools["prefill"].IsObject()) GetThreadPool(pools["prefill"], runtime.prefill_pool);
+            if (pools.HasMember("decode") && pools["decode"].IsObject()) GetThreadPool(pools["decode"], runtime.decode_pool);
+        }
+    }
+
+    static void GetThreadPool(const rapidjson::Value &obj, ThreadPoolConfig &pool){
+        if (obj.HasMember("n_threads") && obj["n_threads"].IsInt()) pool.n_threads = obj["n_threads"].GetInt();
+        if (obj.HasMember("cpumask") && obj["cpumask"].IsString()) pool.cpumask = obj["cpumask"].GetString();
+        if (obj.HasMember("cpu_range") && obj["cpu_range"].IsString()) pool.cpu_range = obj["cpu_range"].GetString();
+        if (obj.HasMember("poll") && obj["poll"].IsInt()) pool.poll = obj["poll"].GetInt();
+        if (obj.HasMember("priority") && obj["priority"].IsInt()) pool.priority = obj["priority"].GetInt();
+        if (obj.HasMember("strict_cpu") && obj["strict_cpu"].IsBool()) pool.strict_cpu = obj["strict_cpu"].GetBool() ? 1 : 0;
+    }
+
+    static void GetGroupAttn(const rapidjson::Value &obj, GroupAttnConfig &ga){
+        if (obj.HasMember("n") && obj["n"].IsInt()) ga.n = obj["n"].GetInt();
+        if (obj.HasMember("w") && obj["w"].IsInt()) ga.w = obj["w"].GetInt();
+        if (ga.n < 1 || ga.w <= 0 || ga.w % ga.n != 0){
+            std::cerr << "group_attn配置无效(n需为正数,w需为n的整数倍),不启用self-extend" << std::endl;
+            ga.n = 1;
+            ga.w = 512;
+        }
+    }
+
     //针对一些特别的无效指令,进行清理
     void command_clean(std::vector<Iaa_Param_Inter> &result, std::string input_str){
         for(auto& r:result){
@@ -184,46 +291,128 @@ public:
         }
     }
 
-    void fix_json(std::string &input_str){
-        input_str = std::regex_replace(input_str, std::regex(R"(\}\s\}\s\])"), "}]" );
-        input_str = std::regex_replace(input_str, std::regex(R"(\}\s\]\s\])"), "}]" );
-        std::regex broken_missing_open(R"(,\s*(?!\{)\s*\"parameter\"\s*:\s*[^}]+\})");
+    //字符串值的存储,保证Iaa_Param_Inter中的字符串指针在下一次解析后依然有效。
+    //已返回的指针可能仍被调用方持有,不能清空,所以池满后不再加入新值,返回nullptr
+    const char* intern(const std::string &str){
+        auto it = str_pool.find(str);
+        if (it != str_pool.end()) return it->c_str();
+        if (str_pool.size() >= kMaxInterned) return nullptr;
+        return str_pool.insert(str).first->c_str();
+    }
+
+    //字符串型参数的值,字符串池已满时回退为该参数的默认值
+    const char* string_value(const std::string &name, const std::string &str){
+        const char *s = intern(str);
+        if (s) return s;
+        auto it = default_param.find(name);
+        return it != default_param.end() ? it->second->get<const char*>() : "";
+    }
+
+    //参数名指向param_list中的键,不进入字符串池;不在列表中的只可能是"无效指令"
+    const char* param_name(const std::string &name) const{
+        auto it = param_list.find(name);
+        return it != param_list.end() ? it->first.c_str() : "无效指令";
+    }
+
+    void push_invalid(std::vector<Iaa_Param_Inter> &result){
+        Iaa_Param_Inter p;
+        p.name = "无效指令";
+        p.value_type = TYPE_STRING;
+        p.value.s = default_param["无效指令"]->get<const char*>();
+        result.push_back(p);
+    }
+
+    //将一条parameter/value转换为Iaa_Param_Inter,parameter不在默认参数列表中时返回false
+    bool make_param(const std::string &name, const rapidjson::Value &value, Iaa_Param_Inter &p){
+        auto it = param_list.find(name);
+        if(it == param_list.end()){
+            return false;
+        }
+        p.name = it->first.c_str();
+        if(it->second==std::string("bool")){
+            p.value_type = TYPE_BOOL;
+            if (value.IsBool()){
+                p.value.b = value.GetBool();
+            }
+            else if (value.IsNumber()){
+                p.value.b = static_cast<bool>(value.GetFloat());
+            }
+            else {
+                p.value.b = static_cast<bool>(default_param[it->first]->get<bool>());
+            }
+        }
+        else if(it->second==std::string("int")){
+            p.value_type = TYPE_INT;
+            if (value.IsNumber()){
+                p.value.i = static_cast<int>(value.GetFloat());
+            }
+            else {
+                p.value.i = static_cast<int>(default_param[it->first]->get<float>());
+            }
+        }
+        else if(it->second==std::string("float")){
+            p.value_type = TYPE_FLOAT;
+            if (value.IsNumber()){
+                p.value.f = value.GetFloat();
+            }
+            else {
+                p.value.f = static_cast<float>(default_param[it->first]->get<float>());
+            }
+        }
+        else if(it->second==std::string("string")){
+            p.value_type = TYPE_STRING;
+            if(value.IsString()){
+                p.value.s = string_value(it->first, value.GetString());
+            }
+            else {
+                p.value.s = static_cast<const char*>(default_param[it->first]->get<const char *>());
+            }
+        }
+        return true;
+    }
 
-        std::smatch match;
-        std::string::const_iterator searchStart(input_str.cbegin());
-        size_t offset = 0;
+    //解析单个{"parameter": ..., "value": ...}对象,parameter不在默认参数列表中时添加"无效指令"字段
+    void pars_object(const rapidjson::Value &obj, std::vector<Iaa_Param_Inter> &result){
+        if(!obj.HasMember("parameter") || !obj.HasMember("value") || !obj["parameter"].IsString()){
+            return;
+        }
+        Iaa_Param_Inter p;
+        if (make_param(obj["parameter"].GetString(), obj["value"], p)){
+            result.push_back(p);
+        }else{
+            if(!invalid_command){
+                push_invalid(result);
+            }
+            invalid_command = true;
+        }
+    }
 
-        while (std::regex_search(searchStart, input_str.cend(), match, broken_missing_open)) {
-            size_t insert_pos = match.position(0) + offset;
-            input_str.insert(insert_pos+1, "{");
-            offset += 1;
-            searchStart = input_str.cbegin() + insert_pos + match.length();
+    //规则快速通道,匹配成功时输出与模型相同的结果,不可信时返回false并保持result不变
+    bool pars_rules(const std::string &utterance, std::vector<Iaa_Param_Inter> &result){
+        rapidjson::Document matched;
+        if (!rules.match(utterance, matched)) return false;
+        std::vector<Iaa_Param_Inter> out;
+        invalid_command = false;
+        for (const auto &obj : matched.GetArray()){
+            pars_object(obj, out);
         }
+        command_clean(out, utterance);
+        result.insert(result.end(), out.begin(), out.end());
+        return true;
     }
 
     int pars_control(std::string input_str, std::vector<Iaa_Param_Inter> &result, std::string user_str){
+        invalid_command = false;
         //正确识别到了无效指令
-        if (strcmp(input_str.c_str(), "暂不支持该操作")==0){
-            Iaa_Param_Inter p;
-            p.name = "无效指令";
-            p.value_type = TYPE_STRING;
-            p.value.s = default_param["无效指令"]->get<const char*>();
-            result.push_back(p);
+        if (input_str == refuse_str){
+            push_invalid(result);
             return 0;
         }
-        //将无效指令识别为了对话类型,或生成的json格式有误
+        //控制模式的输出已由语法约束(见control_grammar.hpp),解析失败说明输出被截断,直接返回无效指令
         if (result_doc.Parse(input_str.c_str()).HasParseError()) {
-            fix_json(input_str);
-            if (result_doc.Parse(input_str.c_str()).HasParseError()){
-                //std::cerr << "ai 指令解析失败！" << std::endl;
-                Iaa_Param_Inter p;
-                p.name = "无效指令";
-                p.value_type = TYPE_STRING;
-                p.value.s = default_param["无效指令"]->get<const char*>();
-                result.push_back(p);
-                return -1;
-            }
-            //else std::cout << "修复成功" << std::endl;
+            //std::cerr << "ai 指令解析失败！" << std::endl;
+            push_invalid(result);
+            return -1;
         }
         //识别正确的json格式和指令内容
         if (result_doc.IsArray()) {
@@ -232,123 +421,11 @@ public:
                     std::cerr << "json元素不是对象!" << std::endl;
                     continue;
                 }
-                if(obj.HasMember("parameter") && obj.HasMember("value")){
-                    auto it = param_list.find(obj["parameter"].GetString());
-                    //解析的parameter在默认参数列表中,否则为无效指令
-                    if(it != param_list.end()){
-                        Iaa_Param_Inter p;
-                        p.name = it->first.c_str();
-                        if(it->second==std::string("bool")){
-                            p.value_type = TYPE_BOOL;
-                            if (obj["value"].IsBool()){
-                                p.value.b = obj["value"].GetBool();
-                            }
-                            else if (obj["value"].IsNumber()){
-                                p.value.b = static_cast<bool>(obj["value"].GetFloat());
-                            }
-                            else {
-                                p.value.b = static_cast<bool>(default_param[it->first]->get<bool>());
-                            }
-                        }
-                        else if(it->second==std::string("int")){
-                            p.value_type = TYPE_INT;
-                            if (obj["value"].IsNumber()){
-                                p.value.i = static_cast<int>(obj["value"].GetFloat());
-                            }
-                            else {
-                                p.value.i = static_cast<int>(default_param[it->first]->get<float>());
-                            }
-                        }
-                        else if(it->second==std::string("float")){
-                            p.value_type = TYPE_FLOAT;
-                            if (obj["value"].IsNumber()){
-                                p.value.f = obj["value"].GetFloat();
-                            }
-                            else {
-                                p.value.f = static_cast<float>(default_param[it->first]->get<float>());
-                            }
-                        }
-                        else if(it->second==std::string("string")){
-                            p.value_type = TYPE_STRING;
-                            if(obj["value"].IsString()){
-                                p.value.s = obj["value"].GetString();
-                            }
-                            else {
-                                p.value.s = static_cast<const char*>(default_param[it->first]->get<const char *>());
-                            }
-                        }
-                        result.push_back(p);
-                    }else{//解析的parameter不在默认参数列表中,添加"无效指令"字段
-                        if(!invalid_command){
-                            Iaa_Param_Inter p;
-                            p.name = "无效指令";
-                            p.value_type = TYPE_STRING;
-                            p.value.s = default_param["无效指令"]->get<const char*>();
-                            result.push_back(p);
-                        }
-                        invalid_command = true;
-                    }
-                }            
+                pars_object(obj, result);
             }
         }else if (result_doc.IsObject())
         {
-            if(result_doc.HasMember("parameter") && result_doc.HasMember("value")){
-                auto it = param_list.find(result_doc["parameter"].GetString());
-                //解析的parameter在默认参数列表中,否则为无效指令
-                if(it != param_list.end()){
-                    Iaa_Param_Inter p;
-                    p.name = it->first.c_str();
-                    if(it->second==std::string("bool")){
-                        p.value_type = TYPE_BOOL;
-                        if (result_doc["value"].IsBool()){
-                            p.value.b = result_doc["value"].GetBool();
-                        }
-                        else if (result_doc["value"].IsNumber()){
-                            p.value.b = static_cast<bool>(result_doc["value"].GetFloat());
-                        }
-                        else {
-                            p.value.b = static_cast<bool>(default_param[it->first]->get<bool>());
-                        }
-                    }
-                    else if(it->second==std::string("int")){
-                        p.value_type = TYPE_INT;
-                        if (result_doc["value"].IsNumber()){
-                            p.value.i = static_cast<int>(result_doc["value"].GetFloat());
-                        }
-                        else {
-                            p.value.i = static_cast<int>(default_param[it->first]->get<float>());
-                        }
-                    }
-                    else if(it->second==std::string("float")){
-                        p.value_type = TYPE_FLOAT;
-                        if (result_doc["value"].IsNumber()){
-                            p.value.f = result_doc["value"].GetFloat();
-                        }
-                        else {
-                            p.value.f = static_cast<float>(default_param[it->first]->get<float>());
-                        }
-                    }
-                    else if(it->second==std::string("string")){
-                        p.value_type = TYPE_STRING;
-                        if(result_doc["value"].IsString()){
-                            p.value.s = result_doc["value"].GetString();
-                        }
-                        else {
-                            p.value.s = static_cast<const char*>(default_param[it->first]->get<const char *>());
-                        }
-                    }
-                    result.push_back(p);
-                }else{//解析的parameter不在默认参数列表中,添加"无效指令"字段
-                    if(!invalid_command){
-                        Iaa_Param_Inter p;
-                        p.name = "无效指令";
-                        p.value_type = TYPE_STRING;
-                        p.value.s = default_param["无效指令"]->get<const char*>();
-                        result.push_back(p);
-                    }
-                    invalid_command = true;
-                }
-            }
+            pars_object(result_doc, result);
         }
         command_clean(result, user_str);
         return 0;
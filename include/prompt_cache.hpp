@@ -0,0 +1,222 @@
+#ifndef PROMPT_CACHE
+#define PROMPT_CACHE
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "llama.h"
+#include "file_hash.hpp"
+
+//system prompt前缀的缓存文件,一个文件中保存多个按名称区分的前缀(每种模式、每个schema各一个).
+//布局:文件头 | 条目表 | 各条目的数据;每个条目的数据从kAlign对齐处开始,依次为前缀token和llama_state_seq_get_data导出的序列KV.
+//加载时mmap整个文件,KV直接从映射的页面写入上下文,不需要先读入临时缓冲区;
+//条目记录生成时的模型指纹、chat模板和前缀token的hash,任何一项与当前不一致时该条目作废,由调用者重新prefill后覆盖
+struct PromptCacheKey{
+    uint64_t model_hash = 0;    //model_fingerprint()
+    uint64_t template_hash = 0; //chat模板源码和格式化选项
+    uint64_t prompt_hash = 0;   //渲染后的system prompt分词结果
+    uint32_t n_tokens = 0;
+};
+
+class PromptCache{
+public:
+    static const uint32_t kMagic = 0x4c504348; //'LPCH'
+    static const uint32_t kVersion = 2;
+    static const uint64_t kAlign = 4096;
+    static const size_t kNameSize = 48;
+
+    explicit PromptCache(const std::string &path) : path_(path){ map(); }
+    ~PromptCache(){ unmap(); }
+
+    PromptCache(const PromptCache &) = delete;
+    PromptCache &operator=(const PromptCache &) = delete;
+
+    const std::string &path() const{ return path_; }
+
+    static uint64_t tokens_hash(const std::vector<llama_token> &tokens){
+        return fnv1a(tokens.data(), tokens.size() * sizeof(llama_token));
+    }
+
+    //条目与key一致时把KV恢复到seq_id(不需要逐token重放),否则返回false并在reason中说明原因
+    bool load(llama_context *ctx, const std::string &name, llama_seq_id seq_id, const PromptCacheKey &key,
+              const std::vector<llama_token> &tokens, std::string &reason) const{
+        if (!data_){
+            reason = "does not exist or has an unknown format";
+            return false;
+        }
+        const Entry *e = find(name);
+        if (!e){
+            reason = "has no entry '" + name + "'";
+            return false;
+        }
+        if (e->model_hash != key.model_hash){
+            reason = "entry '" + name + "' was built for a different model";
+            return false;
+        }
+        if (e->template_hash != key.template_hash){
+            reason = "entry '" + name + "' was built with a different chat template";
+            return false;
+        }
+        if (e->prompt_hash != key.prompt_hash || e->n_tokens != key.n_tokens ||
+            memcmp(data_ + e->tokens_offset, tokens.data(), tokens.size() * sizeof(llama_token)) != 0){
+            reason = "entry '" + name + "' was built for a different system prompt";
+            return false;
+        }
+        //提前让内核按顺序读入KV所在的页面
+        const uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+        const uint64_t begin = e->state_offset / page * page;
+        madvise((void *) (data_ + begin), e->state_offset + e->state_size - begin, MADV_WILLNEED);
+        if (llama_state_seq_set_data(ctx, data_ + e->state_offset, e->state_size, seq_id) == 0){
+            reason = "entry '" + name + "' could not be restored into the context";
+            return false;
+        }
+        return true;
+    }
+
+    //导出seq_id的KV并写入名为name的条目,其它模型生成的条目一并清理,同名条目被替换,其余条目原样保留.
+    //先写临时文件再替换,之后重新映射
+    bool save(llama_context *ctx, const std::string &name, llama_seq_id seq_id, const PromptCacheKey &key,
+              const std::vector<llama_token> &tokens){
+        if (name.size() >= kNameSize) return false;
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, seq_id));
+        if (state.empty() || llama_state_seq_get_data(ctx, state.data(), state.size(), seq_id) != state.size()) return false;
+
+        //保留的旧条目及其在当前映射中的数据,最后一个为新条目
+        std::vector<Entry> entries;
+        std::vector<const uint8_t *> sources;
+        for (uint32_t i = 0; data_ && i < header()->n_entries; i++){
+            const Entry &e = entries_table()[i];
+            if (e.model_hash != key.model_hash || name == e.name) continue;
+            entries.push_back(e);
+            sources.push_back(data_ + e.tokens_offset);
+        }
+        Entry added;
+        memset(&added, 0, sizeof(added));
+        memcpy(added.name, name.c_str(), name.size());
+        added.model_hash = key.model_hash;
+        added.template_hash = key.template_hash;
+        added.prompt_hash = key.prompt_hash;
+        added.n_tokens = key.n_tokens;
+        added.state_size = state.size();
+        entries.push_back(added);
+        sources.push_back(nullptr);
+
+        //重新排布各条目的数据,旧条目内部的相对位置不变
+        uint64_t offset = align(sizeof(Header) + entries.size() * sizeof(Entry));
+        for (size_t i = 0; i < entries.size(); i++){
+            Entry &e = entries[i];
+            const uint64_t state_delta = sources[i] ? e.state_offset - e.tokens_offset : align64(e.n_tokens * sizeof(llama_token));
+            e.tokens_offset = offset;
+            e.state_offset = offset + state_delta;
+            offset = align(e.state_offset + e.state_size);
+        }
+
+        Header h;
+        memset(&h, 0, sizeof(h));
+        h.magic = kMagic;
+        h.version = kVersion;
+        h.n_entries = (uint32_t) entries.size();
+        const std::string tmp = temp_path(path_, this);
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (!f) return false;
+        bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(entries.data(), sizeof(Entry), entries.size(), f) == entries.size();
+        for (size_t i = 0; ok && i < entries.size(); i++){
+            const Entry &e = entries[i];
+            ok = fseek(f, (long) e.tokens_offset, SEEK_SET) == 0;
+            if (ok && sources[i]){
+                const uint64_t size = e.state_offset + e.state_size - e.tokens_offset;
+                ok = fwrite(sources[i], 1, size, f) == size;
+            } else if (ok){
+                ok = fwrite(tokens.data(), sizeof(llama_token), tokens.size(), f) == tokens.size() &&
+                     fseek(f, (long) e.state_offset, SEEK_SET) == 0 &&
+                     fwrite(state.data(), 1, state.size(), f) == state.size();
+            }
+        }
+        ok = fclose(f) == 0 && ok;
+        if (!ok || std::rename(tmp.c_str(), path_.c_str()) != 0){
+            std::remove(tmp.c_str());
+            return false;
+        }
+        unmap();
+        map();
+        return true;
+    }
+
+private:
+    struct Header{
+        uint32_t magic;
+        uint32_t version;
+        uint32_t n_entries;
+        uint32_t reserved;
+    };
+    struct Entry{
+        char name[kNameSize];
+        uint64_t model_hash;
+        uint64_t template_hash;
+        uint64_t prompt_hash;
+        uint32_t n_tokens;
+        uint32_t reserved;
+        uint64_t tokens_offset; //相对文件开头
+        uint64_t state_offset;
+        uint64_t state_size;
+    };
+
+    static uint64_t align(uint64_t n){ return (n + kAlign - 1) / kAlign * kAlign; }
+    static uint64_t align64(uint64_t n){ return (n + 63) / 64 * 64; }
+
+    const Header *header() const{ return (const Header *) data_; }
+    const Entry *entries_table() const{ return (const Entry *) (data_ + sizeof(Header)); }
+
+    const Entry *find(const std::string &name) const{
+        for (uint32_t i = 0; i < header()->n_entries; i++){
+            if (name == entries_table()[i].name) return &entries_table()[i];
+        }
+        return nullptr;
+    }
+
+    //映射整个文件并检查文件头和条目表,格式不对时当作不存在
+    void map(){
+        int fd = open(path_.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(Header)){
+            void *p = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED){
+                data_ = (const uint8_t *) p;
+                size_ = (size_t) st.st_size;
+            }
+        }
+        close(fd);
+        if (data_ && !valid()) unmap();
+    }
+
+    void unmap(){
+        if (data_) munmap((void *) data_, size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    bool valid() const{
+        const Header *h = header();
+        if (h->magic != kMagic || h->version != kVersion) return false;
+        if (sizeof(Header) + (uint64_t) h->n_entries * sizeof(Entry) > size_) return false;
+        for (uint32_t i = 0; i < h->n_entries; i++){
+            const Entry &e = entries_table()[i];
+            if (memchr(e.name, 0, kNameSize) == nullptr) return false;
+            if (e.tokens_offset + (uint64_t) e.n_tokens * sizeof(llama_token) > e.state_offset) return false;
+            if (e.state_offset > size_ || e.state_size > size_ - e.state_offset) return false;
+        }
+        return true;
+    }
+
+    std::string path_;
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+#endif // PROMPT_CACHE
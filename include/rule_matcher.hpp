@@ -0,0 +1,460 @@
+#ifndef RULE_MATCHER
+#define RULE_MATCHER
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "rapidjson/document.h"
+
+//指令控制模式的规则快速通道:用Aho-Corasick自动机匹配参数别名、枚举值、开关动词和无意义的虚词,
+//再配合数字提取,把"打开快门"、"亮度调到50"这类简单语句直接转换为与模型输出相同结构的指令,
+//语句中只要有一处无法解释的内容就认为不可信,交给模型处理
+class RuleMatcher{
+public:
+    enum RuleKind { RULE_PARAM, RULE_ENUM, RULE_ON, RULE_OFF, RULE_FILLER, RULE_AMBIGUOUS, RULE_NUMBER };
+
+    struct RulePattern{
+        std::string text;
+        RuleKind kind;
+        int param;         //params中的下标
+        std::string value; //RULE_ENUM对应的取值
+    };
+
+    struct RuleParam{
+        std::string name;
+        std::string type; //bool/int/float/string
+    };
+
+    std::vector<RuleParam> params;
+    std::vector<RulePattern> patterns;
+
+public:
+    //param_list为 参数名->类型,prompt中的"名称(别名)"和"名称:{取值:标签,...}"会被提取为别名和枚举值
+    void compile(const std::unordered_map<std::string, std::string> &param_list, const std::string &prompt){
+        params.clear();
+        patterns.clear();
+        nodes_.assign(1, Node());
+        std::unordered_map<std::string, int> index;
+        for (const auto &it : param_list){
+            index[it.first] = (int) params.size();
+            params.push_back({it.first, it.second});
+        }
+        //参数名本身,以及"XX开关"的"XX"
+        for (size_t i = 0; i < params.size(); i++){
+            add(params[i].name, RULE_PARAM, (int) i, "");
+            const std::string suffix = "开关";
+            const std::string &name = params[i].name;
+            if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0){
+                add(name.substr(0, name.size() - suffix.size()), RULE_PARAM, (int) i, "");
+            }
+        }
+        extract_prompt(prompt);
+        static const char *kOn[] = { "打开", "开启", "开", "启用", "启动", "开始" };
+        static const char *kOff[] = { "关闭", "关掉", "关上", "关", "禁用", "停止", "停用" };
+        static const char *kFiller[] = { "请", "帮我", "给我", "麻烦", "把", "将", "一下", "和", "跟", "与", "及", "以及", "并", "并且", "同时", "然后", "再",
+                                         "也", "都", "的", "了", "吧", "啊", "呢", "设置", "设置为", "设置成", "设为", "设成", "设到", "调", "调到", "调成", "调为",
+                                         "调整", "调整为", "调整到", "改", "改为", "改成", "切换", "切换到", "切换为", "切换成", "切到", "换成", "换到", "用", "使用",
+                                         "为", "到", "成", "度", "摄氏度", "℃", "°", "°C", "米", "秒", "%" };
+        for (const char *s : kOn) add(s, RULE_ON, -1, "");
+        for (const char *s : kOff) add(s, RULE_OFF, -1, "");
+        for (const char *s : kFiller) add(s, RULE_FILLER, -1, "");
+        build();
+    }
+
+    bool empty() const { return patterns.empty(); }
+
+    //匹配成功时在out中写入[{"parameter": ..., "value": ...}]并返回true,不可信时返回false
+    bool match(const std::string &utterance, rapidjson::Document &out) const{
+        if (empty()) return false;
+        //按 开关动词/参数/枚举值/数字 的顺序组成序列,虚词直接丢弃
+        std::vector<Item> items;
+        size_t pos = 0;
+        for (const auto &m : select(utterance)){
+            if (!scan_gap(utterance, pos, m.first, items)) return false;
+            const RulePattern &p = patterns[m.second];
+            if (p.kind == RULE_AMBIGUOUS) return false;
+            if (p.kind != RULE_FILLER) items.push_back({p.kind, m.second, 0.0});
+            pos = m.first + p.text.size();
+        }
+        if (!scan_gap(utterance, pos, utterance.size(), items)) return false;
+
+        out.SetArray();
+        auto &alloc = out.GetAllocator();
+        std::vector<bool> assigned(params.size(), false);
+        std::vector<int> pending; //还没有遇到开关动词的bool参数
+        int verb = -1;            //当前生效的开关动词,1为打开,0为关闭
+        bool verb_used = true;
+        auto emit = [&](int param, rapidjson::Value &value){
+            if (assigned[param]) return false;
+            assigned[param] = true;
+            rapidjson::Value obj(rapidjson::kObjectType);
+            obj.AddMember("parameter", rapidjson::Value(params[param].name.c_str(), alloc), alloc);
+            obj.AddMember("value", value, alloc);
+            out.PushBack(obj, alloc);
+            return true;
+        };
+        for (size_t i = 0; i < items.size(); i++){
+            const Item &item = items[i];
+            if (item.kind == RULE_ON || item.kind == RULE_OFF){
+                //"快门和中心点打开":动词作用于前面还没有取值的bool参数
+                if (!verb_used && pending.empty()) return false;
+                verb = item.kind == RULE_ON;
+                verb_used = pending.empty() ? false : true;
+                for (int param : pending){
+                    rapidjson::Value v(verb == 1);
+                    if (!emit(param, v)) return false;
+                }
+                pending.clear();
+                continue;
+            }
+            if (item.kind == RULE_NUMBER) return false; //没有对应参数的数字
+            const RulePattern &p = patterns[item.pattern];
+            const RuleParam &param = params[p.param];
+            if (item.kind == RULE_ENUM){
+                //"打开铁红"可以接受,"关闭铁红"语义不明确
+                if (!verb_used && verb == 0) return false;
+                verb_used = true;
+                rapidjson::Value v;
+                if (!enum_value(param, p.value, v, alloc) || !emit(p.param, v)) return false;
+                continue;
+            }
+            const Item *next = i + 1 < items.size() ? &items[i + 1] : nullptr;
+            if (param.type == "bool"){
+                if (verb < 0 || (verb_used && next && (next->kind == RULE_ON || next->kind == RULE_OFF))){
+                    pending.push_back(p.param);
+                } else {
+                    rapidjson::Value v(verb == 1);
+                    if (!emit(p.param, v)) return false;
+                    verb_used = true;
+                }
+            }
+            else if (next && next->kind == RULE_ENUM && patterns[next->pattern].param == p.param){
+                //"色板调成铁红",参数名后面紧跟本参数的枚举值,交给枚举值处理
+                continue;
+            }
+            else if (next && next->kind == RULE_NUMBER && (param.type == "int" || param.type == "float")){
+                if (param.type == "int" && next->number != (double) (int64_t) next->number) return false;
+                rapidjson::Value v;
+                if (param.type == "int") v.SetInt((int) next->number);
+                else v.SetDouble(next->number);
+                if (!emit(p.param, v)) return false;
+                i++;
+            }
+            else{
+                return false;
+            }
+        }
+        return pending.empty() && verb_used && !out.Empty();
+    }
+
+    //语句中决定取值的部分:依次出现的数字、枚举值和开关动词.语义缓存命中时要求两句的这一序列完全相同,
+    //避免"亮度调到50"以很高的相似度命中"亮度调到60"
+    std::vector<std::string> values(const std::string &utterance) const{
+        std::vector<std::string> out;
+        size_t pos = 0;
+        auto scan = [&](size_t end){
+            const std::string gap = utterance.substr(0, end);
+            while (pos < end){
+                double value;
+                const size_t n = parse_number(gap, pos, value);
+                if (n > 0){
+                    char buf[32];
+                    snprintf(buf, sizeof(buf), "%g", value);
+                    out.push_back(buf);
+                    pos += n;
+                    continue;
+                }
+                const unsigned char c = utterance[pos];
+                pos += c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 1;
+            }
+            pos = std::min(pos, end);
+        };
+        if (!empty()){
+            for (const auto &m : select(utterance)){
+                scan(m.first);
+                const RulePattern &p = patterns[m.second];
+                if (p.kind == RULE_ENUM) out.push_back(params[p.param].name + "=" + p.value);
+                else if (p.kind == RULE_ON) out.push_back("on");
+                else if (p.kind == RULE_OFF) out.push_back("off");
+                else if (p.kind == RULE_AMBIGUOUS) out.push_back(p.text);
+                pos = m.first + p.text.size();
+            }
+        }
+        scan(utterance.size());
+        return out;
+    }
+
+    //从pos开始解析阿拉伯数字或中文数字(支持负号/负/零下、小数点、十百千万),成功时返回消耗的字节数
+    static size_t parse_number(const std::string &s, size_t pos, double &value){
+        size_t i = pos;
+        bool negative = false;
+        if (s.compare(i, 1, "-") == 0) { negative = true; i += 1; }
+        else if (s.compare(i, 3, "负") == 0) { negative = true; i += 3; }
+        else if (s.compare(i, 6, "零下") == 0) { negative = true; i += 6; }
+        size_t start = i;
+        if (i < s.size() && isdigit((unsigned char) s[i])){
+            while (i < s.size() && (isdigit((unsigned char) s[i]) || (s[i] == '.' && i + 1 < s.size() && isdigit((unsigned char) s[i + 1])))) i++;
+            value = atof(s.substr(start, i - start).c_str());
+        }
+        else{
+            double total = 0, section = 0, digit = -1;
+            int d;
+            size_t n;
+            bool any = false;
+            while ((n = cn_char(s, i, d)) > 0){
+                any = true;
+                if (d >= 0){
+                    digit = d;
+                }
+                else{
+                    const int unit = -d;
+                    if (unit == 10000){
+                        total = (total + section + std::max(digit, 0.0)) * unit;
+                        section = 0;
+                    }
+                    else{
+                        section += (digit < 0 ? 1 : digit) * unit;
+                    }
+                    digit = -1;
+                }
+                i += n;
+            }
+            if (!any) return 0;
+            value = total + section + std::max(digit, 0.0);
+            //"点"之后逐位读取小数
+            if (s.compare(i, 3, "点") == 0){
+                double scale = 0.1;
+                size_t j = i + 3;
+                bool frac = false;
+                while ((n = cn_char(s, j, d)) > 0 && d >= 0){
+                    value += d * scale;
+                    scale /= 10;
+                    j += n;
+                    frac = true;
+                }
+                if (frac) i = j;
+            }
+        }
+        if (i == start) return 0;
+        if (negative) value = -value;
+        return i - pos;
+    }
+
+private:
+    struct Item{
+        RuleKind kind;
+        int pattern;   //RULE_NUMBER时为-1
+        double number;
+    };
+
+    struct Node{
+        std::map<unsigned char, int> next;
+        int fail = 0;
+        int pattern = -1; //以该节点结尾的模式
+        int output = -1;  //fail链上下一个有模式的节点
+    };
+    std::vector<Node> nodes_;
+
+    //同一文本对应不同含义时标记为有歧义,匹配到时直接交给模型
+    void add(const std::string &text, RuleKind kind, int param, const std::string &value){
+        if (text.empty()) return;
+        int cur = 0;
+        for (unsigned char c : text){
+            auto it = nodes_[cur].next.find(c);
+            if (it == nodes_[cur].next.end()){
+                nodes_[cur].next[c] = (int) nodes_.size();
+                cur = (int) nodes_.size();
+                nodes_.push_back(Node());
+            }
+            else{
+                cur = it->second;
+            }
+        }
+        if (nodes_[cur].pattern >= 0){
+            RulePattern &old = patterns[nodes_[cur].pattern];
+            if (old.kind != kind || old.param != param || old.value != value) old.kind = RULE_AMBIGUOUS;
+            return;
+        }
+        nodes_[cur].pattern = (int) patterns.size();
+        patterns.push_back({text, kind, param, value});
+    }
+
+    void build(){
+        std::queue<int> q;
+        for (const auto &it : nodes_[0].next) q.push(it.second);
+        while (!q.empty()){
+            int cur = q.front();
+            q.pop();
+            for (const auto &it : nodes_[cur].next){
+                int f = nodes_[cur].fail;
+                while (f && !nodes_[f].next.count(it.first)) f = nodes_[f].fail;
+                auto nf = nodes_[f].next.find(it.first);
+                int child = it.second;
+                nodes_[child].fail = (nf != nodes_[f].next.end() && nf->second != child) ? nf->second : 0;
+                const Node &fn = nodes_[nodes_[child].fail];
+                nodes_[child].output = fn.pattern >= 0 ? nodes_[child].fail : fn.output;
+                q.push(child);
+            }
+        }
+    }
+
+    //找出所有匹配,再按最左最长的原则选出互不重叠的匹配,返回(起始位置,模式下标)
+    std::vector<std::pair<size_t, int>> select(const std::string &text) const{
+        std::vector<std::pair<size_t, int>> all;
+        int cur = 0;
+        for (size_t i = 0; i < text.size(); i++){
+            unsigned char c = text[i];
+            while (cur && !nodes_[cur].next.count(c)) cur = nodes_[cur].fail;
+            auto it = nodes_[cur].next.find(c);
+            cur = it != nodes_[cur].next.end() ? it->second : 0;
+            for (int n = nodes_[cur].pattern >= 0 ? cur : nodes_[cur].output; n > 0; n = nodes_[n].output){
+                const int p = nodes_[n].pattern;
+                all.push_back(std::make_pair(i + 1 - patterns[p].text.size(), p));
+            }
+        }
+        std::sort(all.begin(), all.end(), [this](const std::pair<size_t, int> &a, const std::pair<size_t, int> &b){
+            if (a.first != b.first) return a.first < b.first;
+            return patterns[a.second].text.size() > patterns[b.second].text.size();
+        });
+        std::vector<std::pair<size_t, int>> chosen;
+        size_t end = 0;
+        for (const auto &m : all){
+            if (m.first < end) continue;
+            chosen.push_back(m);
+            end = m.first + patterns[m.second].text.size();
+        }
+        return chosen;
+    }
+
+    //匹配之间的空隙只允许出现空白、标点和数字
+    bool scan_gap(const std::string &s, size_t pos, size_t end, std::vector<Item> &items) const{
+        const std::string gap = s.substr(0, end);
+        while (pos < end){
+            unsigned char c = s[pos];
+            if (c < 0x80 && (isspace(c) || (ispunct(c) && c != '-'))){
+                pos++;
+                continue;
+            }
+            size_t n = punct_len(s, pos);
+            if (n > 0){
+                pos += n;
+                continue;
+            }
+            double value;
+            n = parse_number(gap, pos, value);
+            if (n == 0) return false;
+            items.push_back({RULE_NUMBER, -1, value});
+            pos += n;
+        }
+        return true;
+    }
+
+    //中文标点:、。〈〉《》「」『』【】〔〕 以及 ‘’“”… 和全角标点
+    static size_t punct_len(const std::string &s, size_t pos){
+        if (pos + 3 > s.size() || ((unsigned char) s[pos] >> 4) != 0xe) return 0;
+        const uint32_t cp = (((unsigned char) s[pos] & 0x0f) << 12) | (((unsigned char) s[pos + 1] & 0x3f) << 6) | ((unsigned char) s[pos + 2] & 0x3f);
+        if ((cp >= 0x3000 && cp <= 0x3011) || (cp >= 0x2018 && cp <= 0x201d) || cp == 0x2026 ||
+            cp == 0xff01 || cp == 0xff0c || cp == 0xff0e || cp == 0xff1a || cp == 0xff1b || cp == 0xff1f){
+            return 3;
+        }
+        return 0;
+    }
+
+    //中文数字字符,digit>=0为数字,digit<0为单位(-10/-100/-1000/-10000),返回字节数
+    static size_t cn_char(const std::string &s, size_t pos, int &digit){
+        static const char *kDigits[] = { "零", "一", "二", "三", "四", "五", "六", "七", "八", "九" };
+        static const std::pair<const char *, int> kOthers[] = { {"〇", 0}, {"两", 2}, {"十", -10}, {"百", -100}, {"千", -1000}, {"万", -10000} };
+        if (pos + 3 > s.size()) return 0;
+        for (int d = 0; d < 10; d++){
+            if (s.compare(pos, 3, kDigits[d]) == 0) { digit = d; return 3; }
+        }
+        for (const auto &o : kOthers){
+            if (s.compare(pos, 3, o.first) == 0) { digit = o.second; return 3; }
+        }
+        return 0;
+    }
+
+    bool enum_value(const RuleParam &param, const std::string &key, rapidjson::Value &v, rapidjson::Document::AllocatorType &alloc) const{
+        if (param.type == "string"){
+            v.SetString(key.c_str(), alloc);
+            return true;
+        }
+        char *end = nullptr;
+        const double number = strtod(key.c_str(), &end);
+        if (key.empty() || *end != '\0') return false;
+        if (param.type == "int") v.SetInt((int) number);
+        else if (param.type == "float") v.SetDouble(number);
+        else return false;
+        return true;
+    }
+
+    //"快门(挡片)"->快门,挡片;"水平(镜像)翻转"->水平翻转,镜像翻转
+    static std::vector<std::string> expand_alias(const std::string &label){
+        std::vector<std::string> out;
+        size_t l = label.find('('), r = label.find(')');
+        if (l == std::string::npos || r == std::string::npos || r < l){
+            out.push_back(label);
+            return out;
+        }
+        out.push_back(label.substr(0, l) + label.substr(r + 1));
+        out.push_back(label.substr(l + 1, r - l - 1) + label.substr(r + 1));
+        return out;
+    }
+
+    static std::string trim(const std::string &s){
+        size_t b = s.find_first_not_of(" \t\n\r"), e = s.find_last_not_of(" \t\n\r");
+        return b == std::string::npos ? "" : s.substr(b, e - b + 1);
+    }
+
+    //在prompt中查找参数名(最左最长),名称后面紧跟"(别名)"时添加别名,紧跟"{...}"或":{...}"时添加枚举值
+    void extract_prompt(const std::string &prompt){
+        build();
+        for (const auto &m : select(prompt)){
+            const RulePattern p = patterns[m.second];
+            if (p.kind != RULE_PARAM || p.text != params[p.param].name) continue;
+            size_t i = m.first + p.text.size();
+            if (i < prompt.size() && prompt[i] == '('){
+                size_t r = prompt.find(')', i);
+                if (r != std::string::npos){
+                    add(prompt.substr(i + 1, r - i - 1), RULE_PARAM, p.param, "");
+                    i = r + 1;
+                }
+            }
+            if (i < prompt.size() && prompt[i] == ':') i++;
+            if (i >= prompt.size() || prompt[i] != '{') continue;
+            size_t r = prompt.find('}', i);
+            if (r == std::string::npos) continue;
+            std::stringstream entries(prompt.substr(i + 1, r - i - 1));
+            std::string entry;
+            while (std::getline(entries, entry, ',')){
+                entry = trim(entry);
+                std::string key, label;
+                size_t colon = entry.find(':');
+                if (colon != std::string::npos){
+                    key = trim(entry.substr(0, colon));
+                    label = trim(entry.substr(colon + 1));
+                }
+                else{
+                    size_t k = entry[0] == '-' ? 1 : 0;
+                    while (k < entry.size() && isdigit((unsigned char) entry[k])) k++;
+                    key = entry.substr(0, k);
+                    label = trim(entry.substr(k));
+                }
+                if (key.empty() || label.empty()) continue;
+                for (const auto &alias : expand_alias(label)){
+                    add(alias, RULE_ENUM, p.param, key);
+                }
+            }
+        }
+    }
+};
+
+#endif // RULE_MATCHER
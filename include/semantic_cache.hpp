@@ -0,0 +1,207 @@
+#ifndef SEMANTIC_CACHE
+#define SEMANTIC_CACHE
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+//两个向量的点积,向量都已经做过L2归一化,点积即余弦相似度
+static inline float semantic_dot(const float *a, const float *b, int n){
+    int i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8){
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8){
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    sum = _mm_cvtss_f32(s);
+#endif
+    for (; i < n; i++){
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+//语义指令缓存的索引:已验证的 语句embedding->指令 对,按定长记录顺序存放在文件中,通过mmap直接访问,
+//重启后不需要解析即可使用,检索为全量的余弦相似度扫描.记录数达到上限后按环形顺序覆盖最旧的记录,
+//文件按容量倍增预留记录的空间,追加时大多不需要重新映射
+//文件格式: SemanticCacheHeader | record 0 | record 1 | ...
+//record: float embedding[dim] | uint32 payload长度 | payload(kPayloadMax字节)
+class SemanticCache{
+public:
+    static const uint32_t kVersion = 1;
+    static const uint32_t kPayloadMax = 508; //record长度为dim*4+512,dim为16的倍数时每条embedding都是64字节对齐的
+
+    struct SemanticCacheHeader{
+        char magic[4];
+        uint32_t version;
+        uint32_t dim;
+        uint32_t count;
+        uint64_t schema_hash;
+        uint32_t record_size;
+        uint32_t next;        //记录已满时下一条要覆盖的位置
+        uint32_t reserved[8];
+    };
+
+public:
+    //dim或schema_hash(param.json)与文件不一致时清空文件重新建立索引,max_records为记录数的上限
+    SemanticCache(const std::string &path, int dim, uint64_t schema_hash, int max_records) : path_(path){
+        dim_ = dim;
+        max_records_ = (uint32_t) std::max(1, max_records);
+        record_size_ = dim * sizeof(float) + sizeof(uint32_t) + kPayloadMax;
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0){
+            return;
+        }
+        struct stat st;
+        fstat(fd_, &st);
+        SemanticCacheHeader header;
+        bool valid = (size_t) st.st_size >= sizeof(header) && pread(fd_, &header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+                     memcmp(header.magic, "SEMC", 4) == 0 && header.version == kVersion && header.dim == (uint32_t) dim &&
+                     header.schema_hash == schema_hash && header.record_size == record_size_ &&
+                     (size_t) st.st_size >= sizeof(header) + (size_t) header.count * record_size_;
+        if (!valid){
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "SEMC", 4);
+            header.version = kVersion;
+            header.dim = dim;
+            header.schema_hash = schema_hash;
+            header.record_size = record_size_;
+            if (ftruncate(fd_, sizeof(header)) != 0 || pwrite(fd_, &header, sizeof(header), 0) != (ssize_t) sizeof(header)){
+                close(fd_);
+                fd_ = -1;
+                return;
+            }
+        }
+        //上限调小时只保留前max_records条
+        if (header.count > max_records_){
+            header.count = max_records_;
+            header.next = 0;
+            if (pwrite(fd_, &header, sizeof(header), 0) != (ssize_t) sizeof(header)){
+                close(fd_);
+                fd_ = -1;
+                return;
+            }
+        }
+        if (header.next >= header.count) header.next = 0;
+        //已预留的记录空间也映射进来
+        fstat(fd_, &st);
+        capacity_ = std::max(header.count, (uint32_t) std::min<size_t>(max_records_, ((size_t) st.st_size - sizeof(header)) / record_size_));
+        remap(sizeof(header) + (size_t) capacity_ * record_size_);
+        if (ok()) this->header()->next = header.next;
+    }
+
+    ~SemanticCache(){
+        if (base_) munmap(base_, mapped_size_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    bool ok() const { return base_ != nullptr; }
+    size_t size() const { return ok() ? header()->count : 0; }
+
+    //返回相似度不低于threshold的记录(相似度, 下标),按相似度从高到低排列
+    std::vector<std::pair<float, int>> search(const float *query, float threshold) const{
+        std::vector<std::pair<float, int>> hits;
+        for (uint32_t i = 0; ok() && i < header()->count; i++){
+            const float sim = semantic_dot(query, embedding(i), dim_);
+            if (sim >= threshold) hits.push_back(std::make_pair(sim, (int) i));
+        }
+        std::stable_sort(hits.begin(), hits.end(), [](const std::pair<float, int> &a, const std::pair<float, int> &b){
+            return a.first > b.first;
+        });
+        return hits;
+    }
+
+    //文件损坏(长度超出kPayloadMax)时返回空字符串
+    std::string payload(int idx) const{
+        if (!ok() || idx < 0 || (uint32_t) idx >= header()->count) return "";
+        const uint8_t *rec = record(idx) + dim_ * sizeof(float);
+        uint32_t len;
+        memcpy(&len, rec, sizeof(len));
+        if (len > kPayloadMax) return "";
+        return std::string((const char *) rec + sizeof(len), len);
+    }
+
+    //追加一条记录,embedding需已归一化.最相近的记录相似度不低于dedup_threshold且内容相同时不再重复写入;
+    //记录数已达上限时覆盖最旧的一条
+    bool append(const float *embd, const std::string &data, float dedup_threshold){
+        if (!ok() || data.size() > kPayloadMax) return false;
+        const std::vector<std::pair<float, int>> hits = search(embd, dedup_threshold);
+        if (!hits.empty() && payload(hits[0].second) == data) return true;
+        const uint32_t count = header()->count;
+        uint32_t idx = count;
+        if (count >= max_records_){
+            idx = header()->next;
+        } else if (count >= capacity_){
+            const uint32_t capacity = std::min(max_records_, std::max(capacity_ * 2, (uint32_t) kMinCapacity));
+            const size_t new_size = sizeof(SemanticCacheHeader) + (size_t) capacity * record_size_;
+            if (ftruncate(fd_, new_size) != 0) return false;
+            remap(new_size);
+            if (!ok()) return false;
+            capacity_ = capacity;
+        }
+        uint8_t *rec = record(idx);
+        const uint32_t len = data.size();
+        //覆盖旧记录时先把长度置零,中途断电时该记录不会被当作有效的指令
+        memset(rec + dim_ * sizeof(float), 0, sizeof(len));
+        memcpy(rec, embd, dim_ * sizeof(float));
+        memcpy(rec + dim_ * sizeof(float) + sizeof(len), data.data(), len);
+        memcpy(rec + dim_ * sizeof(float), &len, sizeof(len));
+        //记录写完之后再更新数量,中途断电时最多丢失这一条
+        if (count >= max_records_){
+            header()->next = (idx + 1) % max_records_;
+        } else {
+            header()->count = count + 1;
+        }
+        return true;
+    }
+
+private:
+    void remap(size_t size){
+        if (base_) munmap(base_, mapped_size_);
+        base_ = nullptr;
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED) return;
+        base_ = (uint8_t *) addr;
+        mapped_size_ = size;
+    }
+
+    SemanticCacheHeader *header() const { return (SemanticCacheHeader *) base_; }
+    uint8_t *record(uint32_t idx) const { return base_ + sizeof(SemanticCacheHeader) + (size_t) idx * record_size_; }
+    const float *embedding(uint32_t idx) const { return (const float *) record(idx); }
+
+    static const uint32_t kMinCapacity = 16;
+
+    std::string path_;
+    int fd_ = -1;
+    int dim_ = 0;
+    uint32_t record_size_ = 0;
+    uint32_t max_records_ = 0;
+    uint32_t capacity_ = 0; //文件中已预留空间的记录数
+    uint8_t *base_ = nullptr;
+    size_t mapped_size_ = 0;
+};
+
+#endif // SEMANTIC_CACHE
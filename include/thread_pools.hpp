@@ -0,0 +1,92 @@
+#ifndef THREAD_POOLS
+#define THREAD_POOLS
+#include <string>
+#include "common.h"
+#include "log.h"
+#include "llama.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "param_json.hpp"
+
+//prefill和decode分别使用独立的ggml线程池:prefill(n_tokens>1的batch)用所有核心,decode只用大核.
+//llama.cpp对多token的ubatch使用batch线程池,对单token使用普通线程池;空闲的线程池会按poll忙等,
+//所以每次decode之前暂停另一个线程池,被暂停的线程池在下次使用时由ggml自动恢复
+class ThreadPools{
+public:
+    //把param.json或命令行中的配置写入cpu_params,未设置的字段保持不变
+    static bool apply(const ThreadPoolConfig &cfg, cpu_params &cp){
+        if (cfg.n_threads > 0) cp.n_threads = cfg.n_threads;
+        if (!cfg.cpumask.empty()){
+            if (!parse_cpu_mask(cfg.cpumask, cp.cpumask)) return false;
+            cp.mask_valid = true;
+        }
+        if (!cfg.cpu_range.empty()){
+            if (!parse_cpu_range(cfg.cpu_range, cp.cpumask)) return false;
+            cp.mask_valid = true;
+        }
+        if (cfg.poll >= 0) cp.poll = cfg.poll;
+        if (cfg.priority >= 0) cp.priority = (enum ggml_sched_priority) cfg.priority;
+        if (cfg.strict_cpu >= 0) cp.strict_cpu = cfg.strict_cpu != 0;
+        return true;
+    }
+
+    ~ThreadPools(){
+        if (ctx_) llama_detach_threadpool(ctx_);
+        if (free_fn_){
+            if (threadpool_) free_fn_(threadpool_);
+            if (threadpool_batch_) free_fn_(threadpool_batch_);
+        }
+    }
+
+    //按params.cpuparams(decode)和params.cpuparams_batch(prefill)创建线程池并绑定到ctx,两者配置相同时只创建一个
+    bool init(const common_params &params, llama_context *ctx){
+        auto *cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        if (!cpu_dev){
+            LOG_ERR("%s: no CPU backend found\n", __func__);
+            return false;
+        }
+        auto *reg = ggml_backend_dev_backend_reg(cpu_dev);
+        auto *new_fn = (decltype(ggml_threadpool_new) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+        free_fn_ = (decltype(ggml_threadpool_free) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+        if (!new_fn || !free_fn_){
+            LOG_ERR("%s: the CPU backend does not export threadpool functions\n", __func__);
+            return false;
+        }
+
+        struct ggml_threadpool_params tpp_batch = ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
+        struct ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(params.cpuparams);
+        if (!ggml_threadpool_params_match(&tpp, &tpp_batch)){
+            threadpool_batch_ = new_fn(&tpp_batch);
+            if (!threadpool_batch_){
+                LOG_ERR("%s: batch threadpool create failed : n_threads %d\n", __func__, tpp_batch.n_threads);
+                return false;
+            }
+            // Start the non-batch threadpool in the paused state
+            tpp.paused = true;
+        }
+        threadpool_ = new_fn(&tpp);
+        if (!threadpool_){
+            LOG_ERR("%s: threadpool create failed : n_threads %d\n", __func__, tpp.n_threads);
+            return false;
+        }
+        ctx_ = ctx;
+        llama_attach_threadpool(ctx, threadpool_, threadpool_batch_);
+        LOG_INF("%s: prefill threads %d, decode threads %d\n", __func__, tpp_batch.n_threads, tpp.n_threads);
+        return true;
+    }
+
+    //在llama_decode之前调用,batched为batch中是否有多个token;暂停已暂停的线程池没有额外开销.
+    //CPU后端的proc address不提供ggml_threadpool_pause,需直接链接libggml-cpu
+    void prepare(bool batched){
+        if (!threadpool_batch_) return;
+        ggml_threadpool_pause(batched ? threadpool_ : threadpool_batch_);
+    }
+
+private:
+    llama_context *ctx_ = nullptr;
+    struct ggml_threadpool *threadpool_ = nullptr;
+    struct ggml_threadpool *threadpool_batch_ = nullptr;
+    decltype(ggml_threadpool_free) *free_fn_ = nullptr;
+};
+
+#endif // THREAD_POOLS
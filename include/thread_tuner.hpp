@@ -0,0 +1,304 @@
+#ifndef THREAD_TUNER
+#define THREAD_TUNER
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include "common.h"
+#include "log.h"
+#include "llama.h"
+#include "file_hash.hpp"
+#include "thread_pools.hpp"
+#include "trace.hpp"
+
+//启动时的线程数自动调优:对候选的线程数和核心掩码分别测量prefill(多token批次)和单token decode的速度,
+//prefill和decode各自选最快的配置.结果按(模型指纹, CPU型号)保存在缓存文件中,之后启动时直接使用
+struct TunedThreads{
+    int n_threads = 0;          //decode
+    std::string cpumask;        //decode,为空表示不绑定
+    int n_threads_batch = 0;    //prefill
+    std::string cpumask_batch;
+    double decode_ms = 0;       //每个token的decode耗时
+    double prefill_tok_s = 0;
+};
+
+class ThreadTuner{
+public:
+    static const int kPrefillTokens = 64; //合成prefill的token数
+    static const int kDecodeSteps = 8;    //单token decode的次数
+
+    ThreadTuner(const std::string &cache_path, const std::string &model_path) : cache_path_(cache_path){
+        uint64_t fingerprint;
+        if (model_fingerprint(model_path, fingerprint)) model_ = hash_hex(fingerprint);
+        cpu_ = cpu_model();
+    }
+
+    //从缓存文件中查找当前模型和CPU的结果
+    bool lookup(TunedThreads &out) const{
+        rapidjson::Document doc;
+        //没有模型指纹时无法确认缓存的结果属于当前模型
+        if (model_.empty() || !load(doc)) return false;
+        for (const auto &e : doc.GetArray()){
+            if (!e.IsObject() || !e.HasMember("model") || !e.HasMember("cpu") || !e["model"].IsString() || !e["cpu"].IsString()) continue;
+            if (model_ != e["model"].GetString() || cpu_ != e["cpu"].GetString()) continue;
+            if (!e.HasMember("n_threads") || !e["n_threads"].IsInt() || !e.HasMember("n_threads_batch") || !e["n_threads_batch"].IsInt()) continue;
+            out.n_threads = e["n_threads"].GetInt();
+            out.n_threads_batch = e["n_threads_batch"].GetInt();
+            if (e.HasMember("cpumask") && e["cpumask"].IsString()) out.cpumask = e["cpumask"].GetString();
+            if (e.HasMember("cpumask_batch") && e["cpumask_batch"].IsString()) out.cpumask_batch = e["cpumask_batch"].GetString();
+            if (e.HasMember("decode_ms") && e["decode_ms"].IsNumber()) out.decode_ms = e["decode_ms"].GetDouble();
+            if (e.HasMember("prefill_tok_s") && e["prefill_tok_s"].IsNumber()) out.prefill_tok_s = e["prefill_tok_s"].GetDouble();
+            return true;
+        }
+        return false;
+    }
+
+    //在ctx上逐个候选配置跑微基准,结束后清空KV缓存并解除线程池.params提供poll、优先级等其它线程池设置
+    bool tune(const common_params &params, llama_context *ctx, TunedThreads &out){
+        const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(ctx));
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        const int n_batch = std::min((int) kPrefillTokens, (int) llama_n_batch(ctx));
+        llama_batch batch = llama_batch_init(n_batch, 0, 1);
+        //内容不影响耗时,用分散在词表中的token即可
+        std::vector<llama_token> tokens(n_batch);
+        for (int i = 0; i < n_batch; i++) tokens[i] = (llama_token) ((i * 7919 + 13) % n_vocab);
+
+        bool found_decode = false, found_prefill = false;
+        for (const auto &candidate : candidates()){
+            common_params p = params;
+            p.cpuparams.n_threads = p.cpuparams_batch.n_threads = candidate.first;
+            p.cpuparams.mask_valid = p.cpuparams_batch.mask_valid = false;
+            std::fill(std::begin(p.cpuparams.cpumask), std::end(p.cpuparams.cpumask), false);
+            if (!candidate.second.empty()){
+                parse_cpu_mask(candidate.second, p.cpuparams.cpumask);
+                p.cpuparams.mask_valid = true;
+            }
+            p.cpuparams_batch = p.cpuparams;
+            llama_set_n_threads(ctx, candidate.first, candidate.first);
+            double prefill_tok_s = 0, decode_ms = 0;
+            {
+                ThreadPools pools;
+                if (!pools.init(p, ctx) || !measure(ctx, batch, tokens, prefill_tok_s, decode_ms)) continue;
+            }
+            LOG_INF("%s: threads %d mask '%s': prefill %.1f tok/s, decode %.2f ms/token\n", __func__,
+                    candidate.first, candidate.second.c_str(), prefill_tok_s, decode_ms);
+            if (!found_prefill || prefill_tok_s > out.prefill_tok_s){
+                out.n_threads_batch = candidate.first;
+                out.cpumask_batch = candidate.second;
+                out.prefill_tok_s = prefill_tok_s;
+                found_prefill = true;
+            }
+            if (!found_decode || decode_ms < out.decode_ms){
+                out.n_threads = candidate.first;
+                out.cpumask = candidate.second;
+                out.decode_ms = decode_ms;
+                found_decode = true;
+            }
+        }
+        llama_batch_free(batch);
+        llama_memory_clear(llama_get_memory(ctx), true);
+        llama_set_n_threads(ctx, params.cpuparams.n_threads, params.cpuparams_batch.n_threads);
+        if (!found_decode || !found_prefill) return false;
+        LOG_INF("%s: best prefill: threads %d mask '%s', best decode: threads %d mask '%s'\n", __func__,
+                out.n_threads_batch, out.cpumask_batch.c_str(), out.n_threads, out.cpumask.c_str());
+        save(out);
+        return true;
+    }
+
+    //按autotune的配置(off/auto/force)调优并写入params和ctx,跳过或失败时保持原来的配置.
+    //cache_path为调优结果的缓存文件,需在创建线程池之前调用
+    static void autotune(const std::string &mode, const std::string &cache_path, common_params &params, llama_context *ctx){
+        if (mode != "auto" && mode != "force") return;
+        if (pinned(params)){
+            LOG_WRN("%s: threadpool cpumask or cpu range is configured, skipping thread autotune\n", __func__);
+            return;
+        }
+        ThreadTuner tuner(cache_path, params.model.path);
+        TunedThreads tuned;
+        bool ok = mode == "auto" && tuner.lookup(tuned);
+        if (!ok){
+            const double start = Trace::now_us();
+            ok = tuner.tune(params, ctx, tuned);
+            LOG_INF("%s: autotune took %.0f ms\n", __func__, (Trace::now_us() - start) / 1000);
+        }
+        if (ok && apply(tuned, params)){
+            llama_set_n_threads(ctx, params.cpuparams.n_threads, params.cpuparams_batch.n_threads);
+        } else {
+            LOG_WRN("%s: thread autotune failed, using the configured threads\n", __func__);
+        }
+    }
+
+    //param.json或命令行已经指定了cpumask/cpu_range:调优的结果会替换掉用户的绑定,此时不调优
+    static bool pinned(const common_params &params){
+        return params.cpuparams.mask_valid || params.cpuparams_batch.mask_valid;
+    }
+
+    //把结果写入cpu_params,调优只决定线程数和核心掩码
+    static bool apply(const TunedThreads &tuned, common_params &params){
+        ThreadPoolConfig decode, prefill;
+        decode.n_threads = tuned.n_threads;
+        decode.cpumask = tuned.cpumask;
+        prefill.n_threads = tuned.n_threads_batch;
+        prefill.cpumask = tuned.cpumask_batch;
+        params.cpuparams.mask_valid = params.cpuparams_batch.mask_valid = false;
+        std::fill(std::begin(params.cpuparams.cpumask), std::end(params.cpuparams.cpumask), false);
+        std::fill(std::begin(params.cpuparams_batch.cpumask), std::end(params.cpuparams_batch.cpumask), false);
+        return ThreadPools::apply(decode, params.cpuparams) && ThreadPools::apply(prefill, params.cpuparams_batch);
+    }
+
+private:
+    //先prefill一批token,再逐个decode,两次之间清空序列;第一轮作为预热不计时
+    static bool measure(llama_context *ctx, llama_batch &batch, const std::vector<llama_token> &tokens, double &prefill_tok_s, double &decode_ms){
+        llama_memory_t mem = llama_get_memory(ctx);
+        double prefill_us = 0;
+        for (int round = 0; round < 2; round++){
+            llama_memory_seq_rm(mem, 0, -1, -1);
+            common_batch_clear(batch);
+            for (size_t i = 0; i < tokens.size(); i++){
+                common_batch_add(batch, tokens[i], (llama_pos) i, { 0 }, i == tokens.size() - 1);
+            }
+            const double t0 = Trace::now_us();
+            if (llama_decode(ctx, batch)) return false;
+            const double dt = Trace::now_us() - t0;
+            if (round > 0) prefill_us = dt;
+        }
+        const double t0 = Trace::now_us();
+        for (int i = 0; i < kDecodeSteps; i++){
+            common_batch_clear(batch);
+            common_batch_add(batch, tokens[i % tokens.size()], (llama_pos) (tokens.size() + i), { 0 }, true);
+            if (llama_decode(ctx, batch)) return false;
+        }
+        decode_ms = (Trace::now_us() - t0) / 1000 / kDecodeSteps;
+        prefill_tok_s = prefill_us > 0 ? tokens.size() * 1e6 / prefill_us : 0;
+        llama_memory_seq_rm(mem, 0, -1, -1);
+        return true;
+    }
+
+    //候选:所有核心和(大小核架构下)只用大核,线程数取1,2,4...以及核心数
+    static std::vector<std::pair<int, std::string>> candidates(){
+        const int n_cpu = std::max(1, (int) std::thread::hardware_concurrency());
+        std::vector<std::pair<int, std::string>> out;
+        std::vector<int> max_freq(n_cpu, 0);
+        for (int i = 0; i < n_cpu; i++){
+            std::ifstream f("/sys/devices/system/cpu/cpu" + std::to_string(i) + "/cpufreq/cpuinfo_max_freq");
+            f >> max_freq[i];
+        }
+        std::vector<std::pair<std::string, int>> masks = {{"", n_cpu}};
+        const int top = *std::max_element(max_freq.begin(), max_freq.end());
+        const int n_big = (int) std::count(max_freq.begin(), max_freq.end(), top);
+        if (top > 0 && n_big < n_cpu){
+            std::vector<bool> big(n_cpu);
+            for (int i = 0; i < n_cpu; i++) big[i] = max_freq[i] == top;
+            masks.push_back({mask_hex(big), n_big});
+        }
+        for (const auto &m : masks){
+            std::set<int> counts;
+            for (int n = 1; n < m.second; n *= 2) counts.insert(n);
+            counts.insert(m.second);
+            for (int n : counts) out.push_back({n, m.first});
+        }
+        return out;
+    }
+
+    //parse_cpu_mask使用的十六进制格式,最低位为cpu0
+    static std::string mask_hex(const std::vector<bool> &cpus){
+        std::string hex;
+        for (size_t base = 0; base < cpus.size(); base += 4){
+            int nibble = 0;
+            for (size_t b = 0; b < 4 && base + b < cpus.size(); b++){
+                if (cpus[base + b]) nibble |= 1 << b;
+            }
+            hex.insert(hex.begin(), "0123456789abcdef"[nibble]);
+        }
+        return "0x" + hex;
+    }
+
+    //x86为model name,ARM为Hardware和各个CPU part(大小核会有多个),再加上核心数
+    static std::string cpu_model(){
+        std::ifstream f("/proc/cpuinfo");
+        std::set<std::string> parts;
+        std::string line;
+        while (std::getline(f, line)){
+            const size_t colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            std::string key = line.substr(0, colon);
+            key.erase(key.find_last_not_of(" \t") + 1);
+            if (key == "model name" || key == "Hardware" || key == "CPU part"){
+                std::string value = line.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                parts.insert(key + "=" + value);
+            }
+        }
+        std::string out;
+        for (const auto &p : parts) out += p + ";";
+        return out + "cpus=" + std::to_string(std::thread::hardware_concurrency());
+    }
+
+    bool load(rapidjson::Document &doc) const{
+        std::ifstream file(cache_path_);
+        if (!file.is_open()) return false;
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        if (doc.Parse(buffer.str().c_str()).HasParseError() || !doc.IsArray()){
+            std::cerr << "线程调优缓存文件解析失败,忽略: " << cache_path_ << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    //替换当前(模型, CPU)的记录,其它记录保留
+    void save(const TunedThreads &tuned) const{
+        if (model_.empty()) return;
+        rapidjson::Document doc;
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+        writer.StartArray();
+        if (load(doc)){
+            for (const auto &e : doc.GetArray()){
+                if (e.IsObject() && e.HasMember("model") && e.HasMember("cpu") && e["model"].IsString() && e["cpu"].IsString() &&
+                    model_ == e["model"].GetString() && cpu_ == e["cpu"].GetString()) continue;
+                e.Accept(writer);
+            }
+        }
+        writer.StartObject();
+        writer.Key("model");
+        writer.String(model_.c_str());
+        writer.Key("cpu");
+        writer.String(cpu_.c_str());
+        writer.Key("n_threads");
+        writer.Int(tuned.n_threads);
+        writer.Key("cpumask");
+        writer.String(tuned.cpumask.c_str());
+        writer.Key("n_threads_batch");
+        writer.Int(tuned.n_threads_batch);
+        writer.Key("cpumask_batch");
+        writer.String(tuned.cpumask_batch.c_str());
+        writer.Key("decode_ms");
+        writer.Double(tuned.decode_ms);
+        writer.Key("prefill_tok_s");
+        writer.Double(tuned.prefill_tok_s);
+        writer.EndObject();
+        writer.EndArray();
+        //先写临时文件再替换,写到一半时进程退出也不会破坏原来的文件
+        const std::string tmp = temp_path(cache_path_, this);
+        std::ofstream file(tmp, std::ios::out | std::ios::trunc);
+        if (!file.is_open()) return;
+        file << sb.GetString();
+        file.close();
+        if (std::rename(tmp.c_str(), cache_path_.c_str()) != 0) std::remove(tmp.c_str());
+    }
+
+    std::string cache_path_;
+    std::string model_; //模型指纹,读取模型文件失败时为空
+    std::string cpu_;
+};
+
+#endif // THREAD_TUNER
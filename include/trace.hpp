@@ -0,0 +1,179 @@
+#ifndef TRACE
+#define TRACE
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+//可选的时间线追踪:记录嵌套的耗时区间,导出为Chrome trace JSON,可用chrome://tracing或Perfetto打开.
+//每个线程写自己的环形缓冲区(写满后覆盖最旧的事件),记录时不加锁;未开启时每个区间只有一次原子读
+struct TraceEvent{
+    const char *name;     //需为字符串常量
+    const char *arg_name; //可为空
+    int64_t arg;
+    double ts;            //微秒,与GetCurrentUS()同一时钟
+    double dur;
+    int tid;
+};
+
+class Trace{
+public:
+    static const size_t kCapacity = 1 << 16; //每个线程保留的事件数
+    static const int kSessionTrack = 1000;   //会话的请求区间画在单独的轨道上,tid为kSessionTrack+会话号*2+(问答通道为1)
+
+    static bool enabled(){ return flag().load(std::memory_order_relaxed); }
+    static void enable(bool on){ flag().store(on, std::memory_order_relaxed); }
+
+    //全项目共用的微秒时钟
+    static double now_us(){
+        struct timeval time;
+        gettimeofday(&time, NULL);
+        return 1e+6 * time.tv_sec + time.tv_usec;
+    }
+
+    //tid<0时使用当前线程
+    static void record(const char *name, double ts, double dur, const char *arg_name = nullptr, int64_t arg = 0, int tid = -1){
+        if (!enabled()) return;
+        Buffer &b = local();
+        const size_t head = b.head.load(std::memory_order_relaxed);
+        b.events[head % kCapacity] = {name, arg_name, arg, ts, dur, tid < 0 ? b.tid : tid};
+        b.head.store(head + 1, std::memory_order_release);
+    }
+
+    //导出所有线程的事件,应在没有正在记录的线程时调用(如两轮请求之间或退出前)
+    static bool write(const std::string &path){
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> w(sb);
+        std::set<int> tids;
+        w.StartObject();
+        w.Key("displayTimeUnit");
+        w.String("ms");
+        w.Key("traceEvents");
+        w.StartArray();
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            for (const auto &b : registry()){
+                const size_t head = b->head.load(std::memory_order_acquire);
+                for (size_t i = head > kCapacity ? head - kCapacity : 0; i < head; i++){
+                    const TraceEvent &e = b->events[i % kCapacity];
+                    tids.insert(e.tid);
+                    w.StartObject();
+                    w.Key("name");
+                    w.String(e.name);
+                    w.Key("ph");
+                    w.String("X");
+                    w.Key("pid");
+                    w.Int(1);
+                    w.Key("tid");
+                    w.Int(e.tid);
+                    w.Key("ts");
+                    w.Double(e.ts);
+                    w.Key("dur");
+                    w.Double(e.dur);
+                    if (e.arg_name){
+                        w.Key("args");
+                        w.StartObject();
+                        w.Key(e.arg_name);
+                        w.Int64(e.arg);
+                        w.EndObject();
+                    }
+                    w.EndObject();
+                }
+            }
+        }
+        for (int tid : tids){
+            const int lane = tid - kSessionTrack;
+            const std::string name = tid >= kSessionTrack ? "session " + std::to_string(lane / 2) + (lane % 2 ? " chat" : " control")
+                                                          : "thread " + std::to_string(tid);
+            w.StartObject();
+            w.Key("name");
+            w.String("thread_name");
+            w.Key("ph");
+            w.String("M");
+            w.Key("pid");
+            w.Int(1);
+            w.Key("tid");
+            w.Int(tid);
+            w.Key("args");
+            w.StartObject();
+            w.Key("name");
+            w.String(name.c_str());
+            w.EndObject();
+            w.EndObject();
+        }
+        w.EndArray();
+        w.EndObject();
+        FILE *f = fopen(path.c_str(), "wb");
+        if (!f) return false;
+        const bool ok = fwrite(sb.GetString(), 1, sb.GetSize(), f) == sb.GetSize();
+        return fclose(f) == 0 && ok;
+    }
+
+private:
+    struct Buffer{
+        std::vector<TraceEvent> events;
+        std::atomic<size_t> head{0};
+        int tid = 0;
+    };
+
+    static std::atomic<bool> &flag(){
+        static std::atomic<bool> on{false};
+        return on;
+    }
+    static std::mutex &registry_mutex(){
+        static std::mutex m;
+        return m;
+    }
+    static std::vector<std::shared_ptr<Buffer>> &registry(){
+        static std::vector<std::shared_ptr<Buffer>> buffers;
+        return buffers;
+    }
+
+    //每个线程第一次记录时分配缓冲区并登记,只有这一次需要加锁;线程退出后缓冲区仍保留以便导出
+    static Buffer &local(){
+        thread_local Buffer *buffer = nullptr;
+        if (!buffer){
+            std::shared_ptr<Buffer> b(new Buffer());
+            b->events.resize(kCapacity);
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            b->tid = (int) registry().size() + 1;
+            registry().push_back(b);
+            buffer = b.get();
+        }
+        return *buffer;
+    }
+};
+
+//作用域内的一个区间,析构时记录;可在结束前用set_arg补充参数(如token数)
+class TraceScope{
+public:
+    explicit TraceScope(const char *name, const char *arg_name = nullptr, int64_t arg = 0)
+        : name_(Trace::enabled() ? name : nullptr), arg_name_(arg_name), arg_(arg){
+        if (name_) ts_ = Trace::now_us();
+    }
+    ~TraceScope(){
+        if (name_) Trace::record(name_, ts_, Trace::now_us() - ts_, arg_name_, arg_);
+    }
+    void set_arg(const char *arg_name, int64_t arg){
+        arg_name_ = arg_name;
+        arg_ = arg;
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *name_;
+    const char *arg_name_;
+    int64_t arg_;
+    double ts_ = 0;
+};
+
+#endif // TRACE
@@ -0,0 +1,192 @@
+#include "llm_control.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "common.h"
+#include "llama.h"
+#include "log.h"
+#include "param_json.hpp"
+#include "control_engine.hpp"
+#include "thread_pools.hpp"
+#include "thread_tuner.hpp"
+#include "op_profiler.hpp"
+
+struct llm_model {
+    llama_model * model = nullptr;
+    std::string path; //prompt缓存文件头中记录模型指纹
+    int n_threads = -1;
+};
+
+//每个handle有独立的上下文和引擎,只使用一个会话
+struct llm_handle {
+    llm_model * owner = nullptr;
+    llama_context * ctx = nullptr;
+    std::unique_ptr<ParamJson> param_json;
+    std::string param_json_path;
+    common_params params;
+    std::unique_ptr<OpProfiler> profiler;
+    std::unique_ptr<ThreadPools> threadpools;
+    std::unique_ptr<ControlEngine> engine;
+};
+
+static std::once_flag g_backend_once;
+
+extern "C" llm_model * llm_model_load(const char * model_path, int n_threads) {
+    std::call_once(g_backend_once, []() {
+        llama_backend_init();
+    });
+    llama_model * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (!model) {
+        LOG_ERR("%s: error: unable to load model '%s'\n", __func__, model_path);
+        return nullptr;
+    }
+    llm_model * m = new llm_model();
+    m->model = model;
+    m->path = model_path;
+    m->n_threads = n_threads;
+    return m;
+}
+
+extern "C" void llm_model_free(llm_model * model) {
+    if (!model) {
+        return;
+    }
+    llama_model_free(model->model);
+    delete model;
+}
+
+extern "C" llm_handle * llm_init(llm_model * model, const char * param_json_path, const char * prompt_cache_path) {
+    if (!model || !param_json_path || !prompt_cache_path) {
+        return nullptr;
+    }
+    std::unique_ptr<llm_handle> h(new llm_handle());
+    h->owner = model;
+    //ParamJson中保存的是路径指针,需要与handle同生命周期
+    h->param_json_path = param_json_path;
+    h->param_json.reset(new ParamJson(h->param_json_path.c_str()));
+    if (h->param_json->GetParam() != 0) {
+        return nullptr;
+    }
+    if (!h->param_json->runtime.trace_path.empty()) {
+        Trace::enable(true);
+    }
+    const RuntimeConfig & runtime = h->param_json->runtime;
+    common_params & params = h->params;
+    params.model.path = model->path;
+    if (model->n_threads > 0) {
+        params.cpuparams.n_threads = model->n_threads;
+        params.cpuparams_batch.n_threads = model->n_threads;
+    }
+    //与llm_demo相同:param.json中的线程池、自动调优和算子统计设置
+    if (!ThreadPools::apply(runtime.prefill_pool, params.cpuparams_batch) || !ThreadPools::apply(runtime.decode_pool, params.cpuparams)) {
+        LOG_ERR("%s: invalid threadpool cpumask or cpu range\n", __func__);
+        return nullptr;
+    }
+    params.n_parallel = kSeqWork + kSeqPerSession;
+    params.kv_unified = true;
+    if (runtime.n_ctx > 0) {
+        params.n_ctx = runtime.n_ctx;
+    }
+    if (runtime.profile_ops) {
+        h->profiler.reset(new OpProfiler());
+        h->profiler->install(params);
+    }
+    h->ctx = llama_init_from_model(model->model, common_context_params_to_llama(params));
+    if (!h->ctx) {
+        LOG_ERR("%s: failed to create the llama_context\n", __func__);
+        return nullptr;
+    }
+    ThreadTuner::autotune(runtime.autotune, runtime.autotune_path.empty() ? std::string(prompt_cache_path) + ".threads.json" : runtime.autotune_path,
+                          params, h->ctx);
+    h->threadpools.reset(new ThreadPools());
+    if (!h->threadpools->init(params, h->ctx)) {
+        h->threadpools.reset();
+        llama_free(h->ctx);
+        return nullptr;
+    }
+    h->engine.reset(new ControlEngine(params, model->model, h->ctx, *h->param_json));
+    h->engine->set_profiler(h->profiler.get());
+    h->engine->set_thread_pools(h->threadpools.get());
+    if (!h->engine->init(prompt_cache_path)) {
+        h->engine.reset();
+        h->threadpools.reset();
+        llama_free(h->ctx);
+        return nullptr;
+    }
+    return h.release();
+}
+
+extern "C" int llm_infer(llm_handle * handle, const char * utterance, llm_mode mode, const llm_callbacks * callbacks) {
+    if (!handle || !utterance) {
+        return -1;
+    }
+    const llm_callbacks cbs = callbacks ? *callbacks : llm_callbacks();
+    const double t_start = GetCurrentUS();
+    bool failed = false;
+    EngineCallbacks cb;
+    if (cbs.on_token) {
+        cb.on_token = [&cbs](const std::string & piece) {
+            cbs.on_token(piece.c_str(), cbs.user_data);
+        };
+    }
+    if (cbs.on_command) {
+        cb.on_command = [&cbs](const Iaa_Param_Inter & p) {
+            cbs.on_command(&p, cbs.user_data);
+        };
+    }
+    cb.on_done = [&](const EngineStats & stats) {
+        failed = stats.error;
+        if (!cbs.on_done) {
+            return;
+        }
+        auto ms = [t_start](double t) { return t > 0 ? (t - t_start) / 1000 : -1.0; };
+        llm_stats out;
+        out.source = stats.source;
+        out.first_token_ms = ms(stats.t_first_token);
+        out.first_command_ms = ms(stats.t_first_command);
+        out.total_ms = ms(stats.t_done);
+        out.n_prompt = stats.n_prompt;
+        out.n_sampled = stats.n_sampled;
+        out.n_forced = stats.n_forced;
+        out.early_stop = stats.early_stop;
+        out.n_saved_decode = stats.n_saved_decode;
+        out.cancelled = stats.cancelled;
+        out.error = stats.error;
+        cbs.on_done(&out, cbs.user_data);
+    };
+    if (!handle->engine->submit(0, utterance, mode == LLM_MODE_CHAT, cb)) {
+        return -1;
+    }
+    while (handle->engine->step()) {
+    }
+    return failed ? -1 : 0;
+}
+
+extern "C" void llm_cancel(llm_handle * handle) {
+    //正在进行的llama_decode由引擎的abort回调中断,不需要等到这一步结束
+    if (handle && handle->engine) {
+        handle->engine->request_cancel(0);
+    }
+}
+
+extern "C" void llm_free(llm_handle * handle) {
+    if (!handle) {
+        return;
+    }
+    //追踪是进程内全局的,释放时导出到该handle配置的文件
+    if (!handle->param_json->runtime.trace_path.empty()) {
+        Trace::write(handle->param_json->runtime.trace_path);
+    }
+    if (handle->profiler) {
+        LOG("%s", handle->profiler->report(false, 0).c_str());
+    }
+    handle->engine.reset();
+    //线程池需在上下文释放之前解除绑定
+    handle->threadpools.reset();
+    if (handle->ctx) {
+        llama_free(handle->ctx);
+    }
+    delete handle;
+}